@@ -36,6 +36,7 @@ plugin_sources = Split(
   """
   %(PLUGIN_NAME)s_datasource.cpp
   %(PLUGIN_NAME)s_featureset.cpp
+  %(PLUGIN_NAME)s_filter.cpp
   """ % locals())
 
 # Add any external libraries this plugin should
@@ -46,6 +47,8 @@ libraries.append('mapnik')
 # link libicuuc, but ICU_LIB_NAME is used custom builds of icu can
 # have different library names like osx which offers /usr/lib/libicucore.dylib
 libraries.append(env['ICU_LIB_NAME'])
+# zlib inflates gzip/deflate encoded tile responses
+libraries.append('z')
     
 TARGET = plugin_env.SharedLibrary(
               # the name of the target to build, eg 'sqlite.input'
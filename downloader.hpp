@@ -23,230 +23,897 @@
 #ifndef MAPNIK_DOWNLOADER_HPP
 #define MAPNIK_DOWNLOADER_HPP
 
+#include <algorithm>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/bind.hpp>
-#include <boost/bind/protect.hpp>
+#include <boost/function.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/filesystem.hpp>
-#include <boost/format.hpp>
+#include <boost/weak_ptr.hpp>
 // mapnik
 #include <mapnik/box2d.hpp>
+#include <mapnik/utils.hpp>
 
 // urdl
+#include <urdl/connection_pool.hpp>
 #include <urdl/istream.hpp>
+#include <urdl/pipeline.hpp>
 #include <urdl/read_stream.hpp>
+#include <urdl/detail/redirect_cache.hpp>
 
+#include "hedge_policy.hpp"
+#include "host_health.hpp"
+#include "mapped_file.hpp"
 #include "spherical_mercator.hpp"
 
-boost::mutex global_stream_lock;
-
 namespace mapnik {
 
+// Serializes the download log lines on std::cerr. A function-local
+// static is shared by every translation unit including this header.
+inline boost::mutex& global_stream_lock()
+{
+    static boost::mutex m;
+    return m;
+}
+
+// Identifies a tile server for grouping requests and keeping statistics.
+inline std::string host_key(urdl::url const& url)
+{
+    return url.to_string(urdl::url::host_component | urdl::url::port_component);
+}
+
+// Reports an answer from host to its circuit breaker, logging the
+// circuit closing next to the ERROR:download lines.
+inline void record_success(host_health & health, std::string const& host)
+{
+    if (health.success(host))
+    {
+        host_stats stats = health.stats(host);
+        global_stream_lock().lock();
+        std::cerr << "INFO:download circuit closed for " << host << " (" << stats << ")" << std::endl;
+        global_stream_lock().unlock();
+    }
+}
+
+// Reports a transient failure, logging the circuit opening.
+inline void record_failure(host_health & health, std::string const& host)
+{
+    long cooldown_ms = health.failure(host);
+    if (cooldown_ms > 0)
+    {
+        host_stats stats = health.stats(host);
+        global_stream_lock().lock();
+        std::cerr << "WARN:download circuit open for " << host << " for " << cooldown_ms
+                  << "ms (" << stats << ")" << std::endl;
+        global_stream_lock().unlock();
+    }
+}
+
+class download_handler;
+
+// One tile's download, run by a single download_handler or, when it is
+// hedged, by several at once. The first to succeed writes the body and
+// cancels the others; done() runs once every runner has finished.
+class download_race : private boost::noncopyable
+{
+public:
+    download_race(std::string & body, boost::function<void()> const& done)
+        : body_(body),
+          done_(done),
+          running_(0),
+          won_(false)
+    {
+    }
+
+    // Adds a runner, unless the race is already won. Only valid while
+    // another runner is still going, or before the first one starts.
+    bool join(boost::shared_ptr<download_handler> const& runner)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (won_) return false;
+        runners_.push_back(runner);
+        ++running_;
+        return true;
+    }
+
+    bool won() const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        return won_;
+    }
+
+    // Hands over a complete body. Returns false if another runner got
+    // there first.
+    inline bool deliver(std::string & buffer);
+
+    // Called by each runner once it has finished, whether or not it won.
+    void leave()
+    {
+        bool last;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            last = (--running_ == 0);
+        }
+        if (last)
+        {
+            done_();
+        }
+    }
+
+private:
+    mutable boost::mutex mutex_;
+    std::string & body_;
+    boost::function<void()> done_;
+    std::vector<boost::weak_ptr<download_handler> > runners_;
+    std::size_t running_;
+    bool won_;
+};
+
+// Downloads one url for a download_race on the download_service
+// io_service. Everything runs as completion handlers on a strand, so no
+// thread is blocked while a tile is in flight and a handful of threads
+// can keep hundreds of downloads going at once. The handler keeps itself
+// alive through shared_from_this() until it has left the race.
+//
+// Transient failures are retried up to max_retries times after a jittered
+// backoff. Every attempt is reported to the host's circuit breaker, and
+// none is made while the circuit is open.
 class download_handler
     : public boost::enable_shared_from_this<download_handler>
 {
 public:
-    download_handler(boost::asio::io_service& io_service, std::vector<std::string> & tiles)
+    download_handler(boost::asio::io_service& io_service,
+                     boost::shared_ptr<urdl::http::connection_pool> const& pool,
+                     boost::shared_ptr<download_race> const& race,
+                     hedge_policy & hedging,
+                     host_health & health,
+                     int max_retries = 0)
         : io_service_(io_service),
-          tiles_(tiles),
+          race_(race),
+          hedging_(hedging),
+          health_(health),
           strand_(io_service),
-          read_stream_(io_service)
+          read_stream_(io_service),
+          timer_(io_service),
+          hedge_timer_(io_service),
+          retry_timer_(io_service),
+          attempt_(0),
+          max_retries_(std::max(0, max_retries)),
+          retrying_(false),
+          probe_(false),
+          finished_(false)
     {
         read_stream_.set_option(urdl::http::user_agent("Urdl"));
+        read_stream_.set_option(urdl::http::keep_alive(pool));
+        read_stream_.set_option(urdl::http::decompress(true));
+        read_stream_.set_option(urdl::http::cache_redirects(true));
+    }
+
+    // Starts the download; returns at once. If hedge_delay_ms is above 0
+    // and the download is still going after that long, hedge() is called
+    // so that a duplicate can join the race.
+    void async_start(urdl::url const& url, long hedge_delay_ms = 0,
+                     boost::function<void()> const& hedge = boost::function<void()>())
+    {
+        strand_.post(boost::bind(&download_handler::handle_start,
+                                 shared_from_this(), url, hedge_delay_ms, hedge));
+    }
+
+    // Abandons the download because another runner won the race.
+    void cancel()
+    {
+        strand_.post(boost::bind(&download_handler::finish,
+                                 shared_from_this(),
+                                 boost::system::error_code(boost::asio::error::operation_aborted)));
+    }
+
+private:
+    enum {
+        open_timeout_ms = 10000,
+        read_timeout_ms = 5000
+    };
+
+    void handle_start(urdl::url const& url, long hedge_delay_ms,
+                      boost::function<void()> const& hedge)
+    {
+        url_ = url;
+        host_ = host_key(url);
+        if (hedge_delay_ms > 0 && hedge)
+        {
+            hedge_ = hedge;
+            hedge_timer_.expires_from_now(boost::posix_time::milliseconds(hedge_delay_ms));
+            hedge_timer_.async_wait(strand_.wrap(boost::bind(&download_handler::handle_hedge,
+                                                             shared_from_this(), _1)));
+        }
+        start_attempt();
+    }
+
+    void start_attempt()
+    {
+        if (finished_) return;
+        if (!health_.allow(host_, probe_))
+        {
+            finish(boost::asio::error::try_again);
+            return;
+        }
+        ++attempt_;
+        retrying_ = false;
+        buffer_.clear();
+        started_ = boost::posix_time::microsec_clock::universal_time();
+        arm_timer(open_timeout_ms);
+        read_stream_.async_open(url_,
+                                strand_.wrap(boost::bind(&download_handler::handle_open,
+                                                         shared_from_this(), _1, attempt_)));
     }
-    void sync_start(urdl::url const& url)
-    {
-        global_stream_lock.lock(); 
-        std::cerr << "START:" << url.path() << std::endl;
-        std::cerr << "[" << boost::this_thread::get_id()
-                  << "] Thread" << std::endl;  
-        global_stream_lock.unlock(); 
-        
-        urdl::istream is(url);
-        
-        if (is)
-        {
-            is.open_timeout(10000);
-            is.read_timeout(5000);
-            std::stringstream buffer;
-            buffer << is.rdbuf();
-            
-            global_stream_lock.lock(); 
-            tiles_.push_back(buffer.str());
-            global_stream_lock.unlock();
+
+    void handle_open(const boost::system::error_code& ec, int attempt)
+    {
+        // completions of an abandoned attempt are ignored
+        if (finished_ || retrying_ || attempt != attempt_) return;
+        if (ec)
+        {
+            fail(ec);
+            return;
         }
-        else
+        std::size_t length = read_stream_.content_length();
+        if (length != std::size_t(-1))
         {
-            global_stream_lock.lock(); 
-            std::cerr << "ERROR:sync_start " << is.error().message() << std::endl;
-            global_stream_lock.unlock(); 
-        }
-        
-    }
-
-    void async_start(urdl::url const& url, std::string const& output_dir)
-    {       
-        
-        global_stream_lock.lock();
-        std::cerr << "START:" << url.path() << std::endl;
-        global_stream_lock.unlock();
-        
-        file_ = output_dir + url.path();
-        try 
-        {                        
-            boost::filesystem::path p(file_);
-            if (!boost::filesystem::exists(p.parent_path()))
+            buffer_.reserve(length);
+        }
+        read_some();
+    }
+
+    void read_some()
+    {
+        arm_timer(read_timeout_ms);
+        read_stream_.async_read_some(
+            boost::asio::buffer(chunk_),
+            strand_.wrap(boost::bind(&download_handler::handle_read,
+                                     shared_from_this(), _1, _2, attempt_)));
+    }
+
+    void handle_read(const boost::system::error_code& ec, std::size_t length, int attempt)
+    {
+        if (finished_ || retrying_ || attempt != attempt_) return;
+        buffer_.append(chunk_, length);
+        if (!ec)
+        {
+            read_some();
+        }
+        else if (ec == boost::asio::error::eof)
+        {
+            report_success();
+            if (race_->deliver(buffer_))
             {
-                boost::filesystem::create_directories(p.parent_path());
+                boost::posix_time::time_duration elapsed =
+                    boost::posix_time::microsec_clock::universal_time() - started_;
+                hedging_.record(host_, elapsed.total_milliseconds());
             }
-#if 0
-// sync read            
-            ofstream_.open(file_.c_str(), std::ios_base::out | std::ios_base::binary);
-            read_stream_.open(url);
-            for (;;)
+            finish(boost::system::error_code());
+        }
+        else
+        {
+            fail(ec);
+        }
+    }
+
+    // Ends an attempt that went wrong, and retries it if that's worth it.
+    void fail(const boost::system::error_code& ec)
+    {
+        if (!host_health::transient(ec))
+        {
+            // the server answered, if not with the tile
+            if (ec.category() == urdl::http::error_category())
             {
-                char data[1024];
-                boost::system::error_code ec;
-                std::size_t length = read_stream_.read_some(boost::asio::buffer(data), ec);
-                if (ec == boost::asio::error::eof)
-                    break;
-                if (ec)
-                    throw boost::system::system_error(ec);
-                ofstream_.write(data, length);
+                report_success();
             }
-            
-            read_stream_.close();
-            ofstream_.close();
-            global_stream_lock.lock();        
-            std::cerr << "DONE:" << file_ << std::endl;
-            std::cerr << "[" << boost::this_thread::get_id()
-                      << "] Thread Start" << std::endl;        
-            std::cerr << file_ <<  " Done!" << std::endl;
-            global_stream_lock.unlock();
-#else       
-// async     
-            read_stream_.async_open(url, 
-                                    strand_.wrap(boost::bind(&download_handler::handle_open,
-                                                             shared_from_this(), _1)));
-#endif
+            finish(ec);
+            return;
         }
-        catch (boost::filesystem::filesystem_error const& ex)
+        report_failure();
+        if (attempt_ > max_retries_ || race_->won())
         {
-            std::cerr << ex.what() << '\n';
+            finish(ec);
+            return;
         }
-        catch (...)
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+        read_stream_.close(ignored);
+        retrying_ = true; // the closed stream's handlers are ignored
+        retry_timer_.expires_from_now(boost::posix_time::milliseconds(
+                                          health_.retry_delay(host_, attempt_)));
+        retry_timer_.async_wait(strand_.wrap(boost::bind(&download_handler::handle_retry,
+                                                         shared_from_this(), _1)));
+    }
+
+    void handle_retry(const boost::system::error_code& ec)
+    {
+        if (finished_ || ec == boost::asio::error::operation_aborted) return;
+        start_attempt();
+    }
+
+    void report_success()
+    {
+        probe_ = false;
+        record_success(health_, host_);
+    }
+
+    void report_failure()
+    {
+        probe_ = false;
+        record_failure(health_, host_);
+    }
+
+    void handle_hedge(const boost::system::error_code& ec)
+    {
+        if (finished_ || ec == boost::asio::error::operation_aborted) return;
+        if (!race_->won())
         {
-            std::cerr << "Exception caught!!!" << std::endl;
+            hedge_();
         }
-        
     }
-    ~download_handler() 
+
+    void arm_timer(long milliseconds)
+    {
+        timer_.expires_from_now(boost::posix_time::milliseconds(milliseconds));
+        timer_.async_wait(strand_.wrap(boost::bind(&download_handler::handle_timeout,
+                                                   shared_from_this(), _1)));
+    }
+
+    void handle_timeout(const boost::system::error_code& ec)
+    {
+        // a cancelled wait means the timer was re-armed or we are done
+        if (finished_ || retrying_ || ec == boost::asio::error::operation_aborted) return;
+        if (timer_.expires_at() > boost::asio::deadline_timer::traits_type::now()) return;
+        fail(boost::asio::error::timed_out);
+    }
+
+    void finish(const boost::system::error_code& ec)
+    {
+        if (finished_) return;
+        finished_ = true;
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+        hedge_timer_.cancel(ignored);
+        retry_timer_.cancel(ignored);
+        read_stream_.close(ignored);
+        if (probe_)
+        {
+            // cancelled, or lost the race, before the host answered
+            probe_ = false;
+            health_.release(host_);
+        }
+        // losing a hedged race is not an error
+        if (ec && !race_->won())
+        {
+            global_stream_lock().lock();
+            std::cerr << "ERROR:download " << url_.to_string() << " " << ec.message();
+            if (ec == boost::asio::error::try_again)
+            {
+                std::cerr << " (circuit open for " << host_ << ")";
+            }
+            else if (attempt_ > 1)
+            {
+                std::cerr << " (after " << attempt_ << " attempts)";
+            }
+            std::cerr << std::endl;
+            global_stream_lock().unlock();
+        }
+        race_->leave();
+    }
+
+    boost::asio::io_service & io_service_;
+    boost::shared_ptr<download_race> race_;
+    hedge_policy & hedging_;
+    host_health & health_;
+    boost::asio::io_service::strand strand_;
+    urdl::read_stream read_stream_;
+    boost::asio::deadline_timer timer_;
+    boost::asio::deadline_timer hedge_timer_;
+    boost::asio::deadline_timer retry_timer_;
+    boost::function<void()> hedge_;
+    boost::posix_time::ptime started_;
+    urdl::url url_;
+    std::string host_;
+    int attempt_;
+    int max_retries_;
+    bool retrying_;
+    bool probe_;
+    std::string buffer_;
+    char chunk_[8192];
+    bool finished_;
+};
+
+bool download_race::deliver(std::string & buffer)
+{
+    std::vector<boost::weak_ptr<download_handler> > runners;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (won_) return false;
+        won_ = true;
+        body_.swap(buffer);
+        runners.swap(runners_);
+    }
+    // the winner is among them, but it has finished by the time its
+    // cancel() runs
+    for (std::size_t i = 0; i < runners.size(); ++i)
+    {
+        boost::shared_ptr<download_handler> runner = runners[i].lock();
+        if (runner)
+        {
+            runner->cancel();
+        }
+    }
+    return true;
+}
+
+
+// Fetches a run of tiles from one host as a single HTTP/1.1 pipeline.
+// Tiles the server did not answer (it closed the connection early, timed
+// out, or redirected) are handed to retry() so they can be downloaded on
+// their own; done() runs once after that. A tile requested at a
+// remembered redirect's target is retried from its original URL if the
+// target fails it, and the redirect forgotten.
+class pipeline_handler
+    : public boost::enable_shared_from_this<pipeline_handler>
+{
+public:
+    typedef boost::function<void(urdl::url const&, std::size_t)> retry_type;
+
+    pipeline_handler(boost::asio::io_service& io_service,
+                     boost::shared_ptr<urdl::http::connection_pool> const& pool,
+                     std::vector<std::string> & tiles,
+                     host_health & health,
+                     retry_type const& retry,
+                     boost::function<void()> const& done)
+        : tiles_(tiles),
+          health_(health),
+          retry_(retry),
+          done_(done),
+          strand_(io_service),
+          pipeline_(io_service),
+          timer_(io_service),
+          timed_out_(false),
+          probe_(false),
+          finished_(false)
+    {
+        pipeline_.set_option(urdl::http::user_agent("Urdl"));
+        pipeline_.set_option(urdl::http::keep_alive(pool));
+        pipeline_.set_option(urdl::http::decompress(true));
+    }
+
+    // Requests url, which is original or its remembered redirect target.
+    void add(urdl::url const& url, std::size_t index, urdl::url const& original)
+    {
+        urls_.push_back(url);
+        indices_.push_back(index);
+        originals_.push_back(original);
+    }
+
+    void async_start()
     {
+        strand_.post(boost::bind(&pipeline_handler::handle_start,
+                                 shared_from_this()));
     }
+
 private:
-    void handle_open(const boost::system::error_code& ec)
-    {  
-        if (!ec)
+    enum {
+        open_timeout_ms = 10000,
+        read_timeout_ms = 5000
+    };
+
+    void handle_start()
+    {
+        answered_.assign(urls_.size(), false);
+        if (!health_.allow(host_key(urls_.front()), probe_))
         {
-            ofstream_.open(file_.c_str(), std::ios_base::out | std::ios_base::binary);
-            read_stream_.async_read_some(
-                boost::asio::buffer(buffer_),
-                strand_.wrap(boost::bind(&download_handler::handle_read,
-                                         shared_from_this(), _1, _2)));
+            // the single downloads fail fast and report the open circuit
+            handle_done(boost::system::error_code(), 0);
+            return;
         }
-        else
+        arm_timer(open_timeout_ms);
+        // responses are delivered from within the completion handler's
+        // strand, so only that one needs wrapping
+        pipeline_.async_get(urls_,
+                            boost::bind(&pipeline_handler::handle_response,
+                                        shared_from_this(), _1, _2, _3),
+                            strand_.wrap(boost::bind(&pipeline_handler::handle_done,
+                                                     shared_from_this(), _1, _2)));
+    }
+
+    void handle_response(std::size_t i, const boost::system::error_code& ec,
+                         std::string & content)
+    {
+        if (finished_) return;
+        arm_timer(read_timeout_ms);
+        if (ec == urdl::http::errc::moved_permanently ||
+            ec == urdl::http::errc::found)
+        {
+            // let read_stream follow the redirect
+            return;
+        }
+        if (ec && ec != boost::asio::error::operation_aborted &&
+            urls_[i] != originals_[i])
+        {
+            // the remembered redirect no longer works
+            urdl::detail::redirect_cache::instance().erase(originals_[i]);
+            return;
+        }
+        answered_[i] = true;
+        if (ec)
         {
-            //global_stream_lock.lock(); 
-            std::cerr << "Error start:" << ec.message() << std::endl;
-            //global_stream_lock.unlock(); 
+            global_stream_lock().lock();
+            std::cerr << "ERROR:download " << urls_[i].to_string() << " " << ec.message() << std::endl;
+            global_stream_lock().unlock();
+            return;
         }
+        tiles_[indices_[i]].swap(content);
     }
 
-    void handle_read(const boost::system::error_code& ec, std::size_t length)
+    void handle_done(const boost::system::error_code& ec, std::size_t count)
     {
-        if (!ec)
+        if (finished_) return;
+        finished_ = true;
+        // a pipeline that stalled counts against the host even if some
+        // tiles came back first, as a timed out single download would
+        if (timed_out_ || (count == 0 && host_health::transient(ec)))
         {
-            ofstream_.write(buffer_, length);
-            read_stream_.async_read_some(
-                boost::asio::buffer(buffer_),
-                strand_.wrap(boost::bind(&download_handler::handle_read,
-                                         shared_from_this(), _1, _2)));
+            record_failure(health_, host_key(urls_.front()));
         }
-        else if (ec == boost::asio::error::eof)
+        else if (count > 0)
         {
-            //global_stream_lock.lock();        
-            std::cerr << "[" << boost::this_thread::get_id()
-                      << "] Thread Start" << std::endl;        
-            std::cerr << file_ <<  " Done!" << std::endl;
-            //global_stream_lock.unlock();
+            record_success(health_, host_key(urls_.front()));
         }
-        else
+        else if (probe_)
+        {
+            health_.release(host_key(urls_.front()));
+        }
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+        for (std::size_t i = 0; i < urls_.size(); ++i)
         {
-            //global_stream_lock.lock(); 
-            std::cerr << "Error:" <<  ec.message() << std::endl;
-            //global_stream_lock.unlock(); 
+            if (!answered_[i])
+            {
+                retry_(originals_[i], indices_[i]);
+            }
         }
+        done_();
+    }
+
+    void arm_timer(long milliseconds)
+    {
+        timer_.expires_from_now(boost::posix_time::milliseconds(milliseconds));
+        timer_.async_wait(strand_.wrap(boost::bind(&pipeline_handler::handle_timeout,
+                                                   shared_from_this(), _1)));
+    }
 
+    void handle_timeout(const boost::system::error_code& ec)
+    {
+        if (finished_ || ec == boost::asio::error::operation_aborted) return;
+        if (timer_.expires_at() > boost::asio::deadline_timer::traits_type::now()) return;
+        // completes the pipeline with operation_aborted, which retries the rest
+        timed_out_ = true;
+        boost::system::error_code ignored;
+        pipeline_.close(ignored);
     }
-    boost::asio::io_service & io_service_;
+
     std::vector<std::string> & tiles_;
-    boost::asio::strand strand_;
-    urdl::read_stream read_stream_;
-    std::string file_;
-    std::ofstream ofstream_;
-    char buffer_[1024];
+    host_health & health_;
+    retry_type retry_;
+    boost::function<void()> done_;
+    boost::asio::io_service::strand strand_;
+    urdl::http::pipeline pipeline_;
+    boost::asio::deadline_timer timer_;
+    std::vector<urdl::url> urls_;
+    std::vector<std::size_t> indices_;
+    std::vector<urdl::url> originals_;
+    std::vector<bool> answered_;
+    bool timed_out_;
+    bool probe_;
+    bool finished_;
 };
 
 
-class tile_downloader
+// Process-wide pool of download threads running one io_service. It is
+// created on first use and shared by every datasource and featureset, so
+// a query no longer pays for spawning and joining its own threads.
+class download_service
+    : public singleton<download_service, CreateStatic>,
+      private boost::noncopyable
 {
+    friend class CreateStatic<download_service>;
 public:
-    
-    tile_downloader(std::vector<std::string> & cont, int pool_size = 4)    
-        : cont_(cont) 
+    boost::asio::io_service & get_io_service()
     {
-        work_.reset( new boost::asio::io_service::work(io_service_) );
-        
-        for ( int i = 0; i < pool_size; ++i)
+        return io_service_;
+    }
+
+    // Idle keep-alive connections, shared by all downloads so tiles from
+    // the same host skip the TCP (and TLS) handshake.
+    boost::shared_ptr<urdl::http::connection_pool> const& connection_pool() const
+    {
+        return pool_;
+    }
+
+    // Grows the pool to at least pool_size threads; never shrinks it.
+    void reserve_threads(int pool_size)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        for (int i = threads_.size(); i < pool_size; ++i)
         {
             threads_.create_thread( boost::bind(&boost::asio::io_service::run, &io_service_) );
         }
     }
+
+    // Latency history and hedging allowance, shared by all layers.
+    hedge_policy & hedging()
+    {
+        return hedging_;
+    }
+
+    // Circuit breakers and download counters per tile server, shared by
+    // all layers.
+    host_health & health()
+    {
+        return health_;
+    }
+
+    // Logs the counters of tile servers that had failures since the last
+    // report, at most once per host_health::report_interval_ms.
+    void report_health()
+    {
+        std::map<std::string, host_stats> changed;
+        if (!health_.report(changed)) return;
+        global_stream_lock().lock();
+        std::map<std::string, host_stats>::const_iterator itr = changed.begin();
+        for (; itr != changed.end(); ++itr)
+        {
+            std::cerr << "STATS:download " << itr->first << " (" << itr->second << ")" << std::endl;
+        }
+        global_stream_lock().unlock();
+    }
+
+    template <typename TFunc>
+    void post(TFunc fun)
+    {
+        io_service_.post(fun);
+    }
+
+private:
+    download_service()
+        : work_(new boost::asio::io_service::work(io_service_)),
+          pool_(new urdl::http::connection_pool(32))
+    {
+        reserve_threads(4);
+    }
+
+    ~download_service()
+    {
+        work_.reset();
+        io_service_.stop();
+        threads_.join_all();
+        pool_->clear();
+    }
+
+    boost::asio::io_service io_service_;
+    boost::shared_ptr<boost::asio::io_service::work> work_;
+    boost::shared_ptr<urdl::http::connection_pool> pool_;
+    hedge_policy hedging_;
+    host_health health_;
+    boost::mutex mutex_;
+    boost::thread_group threads_;
+};
+
+// One query's batch of downloads on the shared download_service. The
+// destructor waits until every pushed download has finished, so results
+// in cont are complete once it goes out of scope.
+//
+// With a pipeline_depth above 1, pushed tiles are held back until the
+// destructor and then sent in pipelines of up to that many requests per
+// connection to the same host. Tiles under a remembered permanent
+// redirect are pipelined to its target host.
+//
+// Given a mapped vector, file:// tiles are mapped into mapped[index] on
+// the calling thread instead of being read into cont, leaving cont[index]
+// empty. Files that can't be mapped are read as usual.
+//
+// With hedging on, a tile that is still downloading after the chosen
+// percentile of its host's recent latencies gets a duplicate request, on
+// another connection or to the mirror host, and whichever finishes first
+// is kept. Duplicates are limited to the budget percentage of tiles.
+//
+// Each download is tried up to 1 + max_retries times if it fails with a
+// timeout, network error or 5xx status, and not at all while its host's
+// circuit breaker is open.
+class tile_downloader
+{
+public:
+    typedef std::vector<boost::shared_ptr<mapped_file> > mapped_files;
+
+    tile_downloader(std::vector<std::string> & cont, int pipeline_depth = 1,
+                    mapped_files * mapped = 0,
+                    hedge_options const& hedge = hedge_options(),
+                    int max_retries = 0)
+        : service_(*download_service::instance()),
+          cont_(cont),
+          mapped_(mapped),
+          pipeline_depth_(std::max(1, pipeline_depth)),
+          hedge_(hedge),
+          max_retries_(max_retries),
+          pending_(0)
+    {
+    }
     
     ~tile_downloader()
     {
-        work_.reset(); 
-        threads_.join_all();
+        start_pipelines();
+        boost::mutex::scoped_lock lock(mutex_);
+        while (pending_ > 0)
+        {
+            done_.wait(lock);
+        }
+        service_.report_health();
     }
  
-    template <typename TFunc>
-    void push(TFunc fun)
+    // Queues url for download into cont[index]; the caller sizes cont up
+    // front so results keep the order they were requested in.
+    void push(urdl::url const& url, std::size_t index)
     {
-        io_service_.post(
-            boost::bind( &tile_downloader::execute<TFunc>, this, fun )
-            );
+        if (mapped_ && url.protocol() == "file")
+        {
+            boost::shared_ptr<mapped_file> file(new mapped_file(url.path()));
+            if (file->is_open())
+            {
+                (*mapped_)[index] = file;
+                return;
+            }
+        }
+        if (pipeline_depth_ > 1 && url.protocol() == "http")
+        {
+            queued_.push_back(std::make_pair(url, index));
+            return;
+        }
+        start_single(url, index);
     }
     
 private:
  
-    template <typename TFunc>
-    void execute(TFunc fun)
+    void start_single(urdl::url const& url, std::size_t index)
     {
-        boost::shared_ptr<download_handler> d(new download_handler(io_service_,cont_));
-        fun(d);
+        boost::shared_ptr<download_race> race(
+            new download_race(cont_[index],
+                              boost::bind(&tile_downloader::finish, this)));
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            ++pending_;
+        }
+        long hedge_delay = 0;
+        boost::function<void()> hedge;
+        if (hedge_.percentile > 0 && url.protocol() != "file")
+        {
+            service_.hedging().earn(hedge_.budget);
+            hedge_delay = service_.hedging().delay(host_key(url), hedge_.percentile);
+            hedge = boost::bind(&tile_downloader::start_hedge, this, race, url);
+        }
+        start_runner(race, url, hedge_delay, hedge);
+    }
+
+    void start_runner(boost::shared_ptr<download_race> const& race,
+                      urdl::url const& url, long hedge_delay,
+                      boost::function<void()> const& hedge)
+    {
+        boost::shared_ptr<download_handler> d(
+            new download_handler(service_.get_io_service(),
+                                 service_.connection_pool(), race,
+                                 service_.hedging(), service_.health(),
+                                 max_retries_));
+        if (race->join(d))
+        {
+            d->async_start(url, hedge_delay, hedge);
+        }
+    }
+
+    // Runs on a download thread while the first request is still going,
+    // so the race can't have finished and this can't have been destroyed.
+    void start_hedge(boost::shared_ptr<download_race> const& race, urdl::url const& url)
+    {
+        if (!service_.hedging().spend()) return;
+        urdl::url target = url;
+        if (!hedge_.host.empty())
+        {
+            boost::system::error_code ec;
+            target = urdl::url::from_string(url.protocol() + "://" + hedge_.host +
+                                            url.to_string(urdl::url::path_component |
+                                                          urdl::url::query_component), ec);
+            if (ec) target = url;
+        }
+        start_runner(race, target, 0, boost::function<void()>());
+    }
+
+    void start_pipelines()
+    {
+        // group by server, keeping the push order within each group, and
+        // send tiles whose server has moved to where it went, as
+        // read_stream would
+        typedef std::map<std::string, std::vector<std::size_t> > group_map;
+        group_map groups;
+        std::vector<urdl::url> targets(queued_.size());
+        for (std::size_t i = 0; i < queued_.size(); ++i)
+        {
+            urdl::url const& url = queued_[i].first;
+            if (!urdl::detail::redirect_cache::instance().find(url, targets[i]))
+            {
+                targets[i] = url;
+            }
+            else if (targets[i].protocol() != "http")
+            {
+                start_single(url, queued_[i].second);
+                continue;
+            }
+            groups[host_key(targets[i])].push_back(i);
+        }
+        for (group_map::const_iterator itr = groups.begin(); itr != groups.end(); ++itr)
+        {
+            std::vector<std::size_t> const& group = itr->second;
+            for (std::size_t first = 0; first < group.size(); first += pipeline_depth_)
+            {
+                std::size_t last = std::min(group.size(), first + pipeline_depth_);
+                if (last - first == 1)
+                {
+                    start_single(queued_[group[first]].first, queued_[group[first]].second);
+                    continue;
+                }
+                boost::shared_ptr<pipeline_handler> p(
+                    new pipeline_handler(service_.get_io_service(),
+                                         service_.connection_pool(), cont_,
+                                         service_.health(),
+                                         boost::bind(&tile_downloader::start_single, this, _1, _2),
+                                         boost::bind(&tile_downloader::finish, this)));
+                for (std::size_t i = first; i < last; ++i)
+                {
+                    p->add(targets[group[i]], queued_[group[i]].second,
+                           queued_[group[i]].first);
+                }
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    ++pending_;
+                }
+                p->async_start();
+            }
+        }
+        queued_.clear();
+    }
+
+    void finish()
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (--pending_ == 0)
+        {
+            done_.notify_all();
+        }
     }
  
 private:
-    boost::asio::io_service io_service_;
+    download_service & service_;
     std::vector<std::string> & cont_;
-    boost::shared_ptr<boost::asio::io_service::work> work_;
-    boost::thread_group threads_;
+    mapped_files * mapped_;
+    std::size_t pipeline_depth_;
+    hedge_options hedge_;
+    int max_retries_;
+    std::vector<std::pair<urdl::url, std::size_t> > queued_;
+    boost::mutex mutex_;
+    boost::condition_variable done_;
+    std::size_t pending_;
 };
 }
 #endif // MAPNIK_DOWNLOADER_HPP
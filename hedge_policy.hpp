@@ -0,0 +1,129 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MAPNIK_HEDGE_POLICY_HPP
+#define MAPNIK_HEDGE_POLICY_HPP
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace mapnik {
+
+// Per-layer settings for hedged tile requests. A percentile of 0 turns
+// hedging off; budget is the most extra requests hedging may add, as a
+// percentage of tiles requested; host, if set, is the host[:port] of a
+// mirror that duplicates are sent to instead of the original host.
+struct hedge_options
+{
+    int percentile;
+    int budget;
+    std::string host;
+
+    hedge_options()
+        : percentile(0), budget(5), host() {}
+};
+
+// Recent download latencies per host, and the shared allowance of hedged
+// requests. Safe to use from every download thread.
+class hedge_policy : private boost::noncopyable
+{
+public:
+    enum {
+        window_size = 256,   // latencies remembered per host
+        min_samples = 20,    // before a percentile is trusted
+        max_tokens = 10      // hedges that can be saved up for a burst
+    };
+
+    hedge_policy()
+        : tokens_(0.0) {}
+
+    void record(std::string const& host, long milliseconds)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        window & w = windows_[host];
+        if (w.samples.size() < window_size)
+        {
+            w.samples.push_back(milliseconds);
+        }
+        else
+        {
+            w.samples[w.next] = milliseconds;
+            w.next = (w.next + 1) % window_size;
+        }
+    }
+
+    // How long a tile from host may take before it is hedged, or 0 if
+    // there is not enough history to say.
+    long delay(std::string const& host, int percentile) const
+    {
+        std::vector<long> samples;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            std::map<std::string, window>::const_iterator itr = windows_.find(host);
+            if (itr == windows_.end() || itr->second.samples.size() < min_samples)
+            {
+                return 0;
+            }
+            samples = itr->second.samples;
+        }
+        std::size_t rank = samples.size() * std::min(std::max(percentile, 1), 99) / 100;
+        std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+        return std::max(samples[rank], 1L);
+    }
+
+    // Earns budget percent of a hedge for one requested tile.
+    void earn(int budget)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        tokens_ = std::min(tokens_ + std::max(budget, 0) / 100.0, double(max_tokens));
+    }
+
+    // Spends one hedge, if the budget allows it.
+    bool spend()
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (tokens_ < 1.0) return false;
+        tokens_ -= 1.0;
+        return true;
+    }
+
+private:
+    struct window
+    {
+        std::vector<long> samples;
+        std::size_t next;
+        window() : samples(), next(0) {}
+    };
+
+    mutable boost::mutex mutex_;
+    std::map<std::string, window> windows_;
+    double tokens_;
+};
+
+}
+
+#endif // MAPNIK_HEDGE_POLICY_HPP
@@ -0,0 +1,294 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MAPNIK_HOST_HEALTH_HPP
+#define MAPNIK_HOST_HEALTH_HPP
+
+#include <algorithm>
+#include <ctime>
+#include <map>
+#include <ostream>
+#include <string>
+
+#include <boost/asio/error.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+
+// urdl
+#include <urdl/http.hpp>
+
+namespace mapnik {
+
+// Download counters for one tile server.
+struct host_stats
+{
+    std::size_t attempts;   // requests sent, retries included
+    std::size_t successes;  // requests the server answered
+    std::size_t failures;   // requests lost to timeouts, network errors or 5xx
+    std::size_t retries;    // failed requests that were tried again
+    std::size_t rejected;   // requests failed at once while the circuit was open
+    bool open;              // whether the circuit is open now
+
+    host_stats()
+        : attempts(0), successes(0), failures(0), retries(0), rejected(0), open(false) {}
+};
+
+inline std::ostream & operator<<(std::ostream & out, host_stats const& s)
+{
+    return out << "attempts=" << s.attempts << " successes=" << s.successes
+               << " failures=" << s.failures << " retries=" << s.retries
+               << " rejected=" << s.rejected
+               << " circuit=" << (s.open ? "open" : "closed");
+}
+
+// Per-host circuit breaker. After failure_threshold failures in a row a
+// host's circuit opens and requests to it fail at once, instead of each
+// waiting out a timeout. Once the cool-down has passed a single probe
+// request is let through: success closes the circuit, failure opens it
+// again for twice as long, up to max_cooldown_ms. A probe that ends with
+// neither, e.g. because it was cancelled, must be released so another
+// request can probe. Safe to use from every download thread.
+class host_health : private boost::noncopyable
+{
+public:
+    enum {
+        failure_threshold = 5,
+        min_cooldown_ms = 1000,
+        max_cooldown_ms = 30000,
+        probe_timeout_ms = 15000,  // after which another probe may go
+        retry_base_ms = 100,
+        retry_max_ms = 2000,
+        report_interval_ms = 60000
+    };
+
+    host_health()
+        : random_(static_cast<boost::uint32_t>(std::time(0))) {}
+
+    virtual ~host_health() {}
+
+    // Errors worth retrying, and that count against the host: anything
+    // but a cancellation or an answer the server meant to give.
+    static bool transient(boost::system::error_code const& ec)
+    {
+        if (!ec || ec == boost::asio::error::operation_aborted) return false;
+        if (ec.category() == urdl::http::error_category())
+        {
+            return ec == urdl::http::errc::internal_server_error ||
+                ec == urdl::http::errc::bad_gateway ||
+                ec == urdl::http::errc::service_unavailable ||
+                ec == urdl::http::errc::gateway_timeout;
+        }
+        return true;
+    }
+
+    // Whether a request to host may go ahead. Counts it as an attempt if
+    // so, or as rejected if the circuit is open. probe is set if the
+    // request is the circuit's probe, which must end in success(),
+    // failure() or release().
+    bool allow(std::string const& host, bool & probe)
+    {
+        probe = false;
+        boost::posix_time::ptime now = current_time();
+        boost::mutex::scoped_lock lock(mutex_);
+        entry & e = hosts_[host];
+        if (e.state == half_open && now >= e.probe_expires)
+        {
+            e.state = open;
+        }
+        if (e.state == open)
+        {
+            if (now < e.open_until)
+            {
+                ++e.stats.rejected;
+                return false;
+            }
+            e.state = half_open;
+            e.probe_expires = now + boost::posix_time::milliseconds(long(probe_timeout_ms));
+            probe = true;
+        }
+        else if (e.state == half_open)
+        {
+            ++e.stats.rejected;
+            return false;
+        }
+        ++e.stats.attempts;
+        return true;
+    }
+
+    // Records that host answered. Returns true if that closed its circuit.
+    bool success(std::string const& host)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        entry & e = hosts_[host];
+        ++e.stats.successes;
+        e.consecutive_failures = 0;
+        e.cooldown_ms = min_cooldown_ms;
+        bool was_open = (e.state != closed);
+        e.state = closed;
+        return was_open;
+    }
+
+    // Records a transient failure against host. Returns the cool-down in
+    // milliseconds if that opened its circuit, or 0.
+    long failure(std::string const& host)
+    {
+        boost::posix_time::ptime now = current_time();
+        boost::mutex::scoped_lock lock(mutex_);
+        entry & e = hosts_[host];
+        ++e.stats.failures;
+        ++e.consecutive_failures;
+        if (e.state == open)
+        {
+            // requests already in flight when the circuit opened
+            return 0;
+        }
+        if (e.state == half_open)
+        {
+            e.cooldown_ms = std::min(e.cooldown_ms * 2, long(max_cooldown_ms));
+        }
+        else if (e.consecutive_failures < failure_threshold)
+        {
+            return 0;
+        }
+        e.state = open;
+        e.open_until = now + boost::posix_time::milliseconds(e.cooldown_ms);
+        return e.cooldown_ms;
+    }
+
+    // Ends a probe that got no answer either way. The circuit goes back
+    // to open with its current cool-down, which has already run out, so
+    // the next request probes again.
+    void release(std::string const& host)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        entry & e = hosts_[host];
+        if (e.state == half_open)
+        {
+            e.state = open;
+        }
+    }
+
+    // Records a retry and returns how long to wait before it: exponential
+    // in the number of earlier attempts, with jitter so that the tiles of
+    // one render don't all come back at the same moment.
+    long retry_delay(std::string const& host, int attempt)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        ++hosts_[host].stats.retries;
+        long ceiling = std::min(long(retry_max_ms), long(retry_base_ms) << std::min(attempt, 10));
+        return ceiling / 2 + long(random_() % (ceiling / 2 + 1));
+    }
+
+    host_stats stats(std::string const& host) const
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        std::map<std::string, entry>::const_iterator itr = hosts_.find(host);
+        return itr == hosts_.end() ? host_stats() : snapshot(itr->second);
+    }
+
+    // Fills changed with the counters of hosts that had failures, retries
+    // or rejections since the last report, at most once per
+    // report_interval_ms. Returns false if it isn't time yet or there is
+    // nothing new.
+    bool report(std::map<std::string, host_stats> & changed)
+    {
+        boost::posix_time::ptime now = current_time();
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!last_report_.is_not_a_date_time() &&
+            now < last_report_ + boost::posix_time::milliseconds(long(report_interval_ms)))
+        {
+            return false;
+        }
+        last_report_ = now;
+        std::map<std::string, entry>::iterator itr = hosts_.begin();
+        for (; itr != hosts_.end(); ++itr)
+        {
+            entry & e = itr->second;
+            if (e.stats.failures != e.reported.failures ||
+                e.stats.retries != e.reported.retries ||
+                e.stats.rejected != e.reported.rejected)
+            {
+                changed[itr->first] = snapshot(e);
+                e.reported = e.stats;
+            }
+        }
+        return !changed.empty();
+    }
+
+    // Counters for every host seen so far, keyed by host[:port].
+    std::map<std::string, host_stats> stats() const
+    {
+        std::map<std::string, host_stats> result;
+        boost::mutex::scoped_lock lock(mutex_);
+        std::map<std::string, entry>::const_iterator itr = hosts_.begin();
+        for (; itr != hosts_.end(); ++itr)
+        {
+            result[itr->first] = snapshot(itr->second);
+        }
+        return result;
+    }
+
+protected:
+    // The clock behind cool-downs, probe timeouts and report intervals;
+    // tests replace it to control time.
+    virtual boost::posix_time::ptime current_time() const
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+private:
+    enum state_t { closed, open, half_open };
+
+    struct entry
+    {
+        host_stats stats;
+        host_stats reported;  // as of the last report()
+        state_t state;
+        int consecutive_failures;
+        long cooldown_ms;
+        boost::posix_time::ptime open_until;
+        boost::posix_time::ptime probe_expires;
+
+        entry()
+            : stats(), reported(), state(closed), consecutive_failures(0),
+              cooldown_ms(min_cooldown_ms) {}
+    };
+
+    static host_stats snapshot(entry const& e)
+    {
+        host_stats s = e.stats;
+        s.open = (e.state != closed);
+        return s;
+    }
+
+    mutable boost::mutex mutex_;
+    std::map<std::string, entry> hosts_;
+    boost::posix_time::ptime last_report_;
+    boost::mt19937 random_;
+};
+
+}
+
+#endif // MAPNIK_HOST_HEALTH_HPP
@@ -25,10 +25,10 @@
 #include <boost/algorithm/string.hpp>
 // mapnik
 #include <mapnik/box2d.hpp>
-#include <mapnik/proj_transform.hpp>
 
 #include <string>
 #include <algorithm>
+#include <cmath>
 
 #include <urdl/istream.hpp>
 // yajl
@@ -37,6 +37,8 @@
 // file plugin
 #include "jit_datasource.hpp"
 #include "jit_featureset.hpp"
+#include "spherical_mercator.hpp"
+#include "downloader.hpp"
 
 #ifdef MAPNIK_DEBUG
 //#include <mapnik/timer.hpp>
@@ -49,6 +51,38 @@ using mapnik::parameters;
 
 DATASOURCE_PLUGIN(jit_datasource)
 
+namespace {
+
+const double MERCA = 6378137;
+const double MAX_LATITUDE = 85.0511287798066;
+
+// Closed forms of the spherical mercator (+proj=merc +a=6378137 +over)
+// <-> WGS84 transform. Both are monotonic in each axis, so converting the
+// corners converts the box, without setting up proj4 per call.
+void merc_to_lonlat(mapnik::box2d<double> & box)
+{
+    box.init(box.minx() / MERCA * RAD_TO_DEG,
+             (2 * std::atan(std::exp(box.miny() / MERCA)) - 0.5 * M_PI) * RAD_TO_DEG,
+             box.maxx() / MERCA * RAD_TO_DEG,
+             (2 * std::atan(std::exp(box.maxy() / MERCA)) - 0.5 * M_PI) * RAD_TO_DEG);
+}
+
+double lat_to_merc(double lat)
+{
+    lat = std::min(std::max(lat, -MAX_LATITUDE), MAX_LATITUDE);
+    return MERCA * std::log(std::tan(0.25 * M_PI + 0.5 * lat * DEG_TO_RAD));
+}
+
+void lonlat_to_merc(mapnik::box2d<double> & box)
+{
+    box.init(MERCA * box.minx() * DEG_TO_RAD,
+             lat_to_merc(box.miny()),
+             MERCA * box.maxx() * DEG_TO_RAD,
+             lat_to_merc(box.maxy()));
+}
+
+}
+
 jit_datasource::jit_datasource(parameters const& params, bool bind)
     : datasource(params),
     type_(datasource::Vector),
@@ -57,10 +91,30 @@ jit_datasource::jit_datasource(parameters const& params, bool bind)
     url_(*params_.get<std::string>("url", "")),
     minzoom_(0),
     maxzoom_(10),
+    tile_size_(*params_.get<int>("tile_size", 0)),
+    cluster_size_(*params_.get<int>("cluster_size", 0)),
+    max_tiles_(std::max(0, *params_.get<int>("max_tiles", 0))),
+    zoom_offset_(*params_.get<int>("zoom_offset", 0)),
+    overzoom_(*params_.get<mapnik::boolean>("overzoom", true)),
+    pipeline_depth_(*params_.get<int>("pipeline_depth", 1)),
+    hedge_(),
+    max_retries_(std::max(0, *params_.get<int>("max_retries", 2))),
+    tile_cache_(new mapnik::tile_cache(
+        std::max(0, *params_.get<int>("tile_cache_size", 64)))),
+    filter_(*params_.get<std::string>("filter", "")),
     extent_() {
     if (url_.empty()) {
       throw mapnik::datasource_exception("JIT Plugin: missing <url> parameter");
     }
+    // the download pool is shared by every datasource in the process,
+    // so this only ever grows it
+    int download_threads = *params_.get<int>("download_threads", 0);
+    if (download_threads > 0) {
+        mapnik::download_service::instance()->reserve_threads(download_threads);
+    }
+    hedge_.percentile = std::min(99, std::max(0, *params_.get<int>("hedge_percentile", 0)));
+    hedge_.budget = std::max(0, *params_.get<int>("hedge_budget", 5));
+    hedge_.host = *params_.get<std::string>("hedge_host", "");
     if (bind) {
         this->bind();
     }
@@ -69,28 +123,25 @@ jit_datasource::jit_datasource(parameters const& params, bool bind)
 void jit_datasource::bind() const {
     if (is_bound_) return;
 
-    mapnik::projection const merc =  mapnik::projection(MERCATOR_PROJ4);
-    mapnik::projection const wgs84 = mapnik::projection("+proj=lonlat +datum=WGS84");
     // std::map<std::string, mapnik::parameters> statistics_;
 
     // Paths for yajl
     const char * minzoom_path[] = { "minzoom", (const char *) 0 };
     const char * maxzoom_path[] = { "maxzoom", (const char *) 0 };
     const char * vectors_path[] = { "vectors", (const char *) 0 };
+    const char * tile_size_path[] = { "tile_size", (const char *) 0 };
     const char * type_path[] = { "data", "geometry_type", (const char *) 0 };
     const char * bounds_path[] = { "bounds", (const char *) 0 };
     const char * statistics_path[] = { "statistics", (const char *) 0 };
 
-    mapnik::proj_transform transformer(merc, wgs84);
-
     urdl::istream is(url_);
     if (!is)
     {
         throw mapnik::datasource_exception("JIT Plugin: TileJSON endpoint could not be reached.");
     }
-    std::stringstream buffer;
-    buffer << is.rdbuf();
-    std::string tjstring(buffer.str());
+    std::string tjstring;
+    is.buffer_size(64 * 1024);
+    is.read_content(tjstring);
     boost::trim_left(tjstring);
 
     char errbuf[1024];
@@ -109,9 +160,19 @@ void jit_datasource::bind() const {
     v = yajl_tree_get(node, maxzoom_path, yajl_t_number);
     maxzoom_ = YAJL_GET_INTEGER(v);
 
+    // An explicit tile_size parameter wins over the TileJSON.
+    if (tile_size_ <= 0) {
+        v = yajl_tree_get(node, tile_size_path, yajl_t_number);
+        tile_size_ = (v != NULL) ? YAJL_GET_INTEGER(v) : 256;
+    }
+    if (tile_size_ <= 0) {
+        throw mapnik::datasource_exception("JIT Plugin: tile_size must be positive.");
+    }
+
     v = yajl_tree_get(node, vectors_path, yajl_t_string);
     char* ts = YAJL_GET_STRING(v);
     tileurl_ = std::string(ts);
+    tileurl_template_ = mapnik::tile_url_template(tileurl_);
 
     v = yajl_tree_get(node, type_path, yajl_t_string);
     if (v != NULL) {
@@ -157,7 +218,7 @@ void jit_datasource::bind() const {
           YAJL_GET_DOUBLE(YAJL_GET_ARRAY(v)->values[2]),
           YAJL_GET_DOUBLE(YAJL_GET_ARRAY(v)->values[3]));
 
-      transformer.backward(latBox);
+      lonlat_to_merc(latBox);
       extent_ = latBox;
     } else {
 #ifdef MAPNIK_DEBUG
@@ -210,37 +271,75 @@ mapnik::statistics_ptr jit_datasource::get_statistics() const {
 mapnik::featureset_ptr jit_datasource::features(mapnik::query const& q) const {
     if (!is_bound_) bind();
 
-    mapnik::projection const merc = mapnik::projection(MERCATOR_PROJ4);
-    mapnik::projection const wgs84 = mapnik::projection("+proj=lonlat +datum=WGS84");
-    mapnik::proj_transform transformer(merc, wgs84);
     mapnik::box2d <double> bb = q.get_unbuffered_bbox();
-    transformer.forward(bb);
+    const double mercwidth = bb.width();
+    merc_to_lonlat(bb);
     
     if (bb.width() == 0) {
         // Invalid tiles mean we'll do dangerous math.
         return mapnik::featureset_ptr();
     }
     
-    mapnik::coord2d c = bb.center();
-    
     const double MAXEXTENT = 20037508.34;
-    const double MERCA = 6378137;
-    const double D2R = M_PI / 180.0;
-    double mercwidth = (MERCA * bb.maxx() * D2R) -
-      (MERCA * bb.minx() * D2R);
-    
-// FIXME !! ////////////////////////////////////////////////
-    double z = abs(ceil(-(std::log(mercwidth / MAXEXTENT) -
-      std::log(2.0)) / std::log(2.0)));
-///////////////////////////////////////////////////////////
+    const double tile_size = tile_size_;
+
+    // Pick the zoom whose tiles are drawn at (close to) one tile pixel
+    // per output pixel. query.resolution() is output pixels per map unit
+    // (mercator meters); without it, assume the bbox spans a single tile.
+    double resolution = boost::get<0>(q.resolution());
+    if (!(resolution > 0)) {
+        resolution = tile_size / mercwidth;
+    }
+    double exact_z = std::log(2 * MAXEXTENT * resolution / tile_size) /
+      std::log(2.0);
+    int z = int(std::floor(exact_z + 0.5)) + zoom_offset_;
+    if (z < 0) z = 0;
     
+    // Past maxzoom, reuse the covering maxzoom tiles instead: they hold
+    // the same data, and nearby deep-zoom queries share them via the
+    // tile cache. Points are still clustered at the query zoom.
+    const int query_z = z;
+    bool overzoomed = false;
+    if (z > maxzoom_ && overzoom_) {
+        z = maxzoom_;
+        overzoomed = true;
+    }
+
     // Also bail early if the datasource indicates that there
     // will be no tiles here.
     if (z > maxzoom_ || z < minzoom_) {
         return mapnik::featureset_ptr();
     }
-    // passed transformed bbox (WGS84) and zoom level
-    return boost::make_shared<jit_featureset>(bb, z, tileurl_, desc_.get_encoding());
+    // Points are only clustered when the layer declares a point
+    // geometry type; lines and polygons can't be merged this way.
+    int cluster_size = 0;
+    boost::optional<mapnik::datasource::geometry_t> geom_type = get_geometry_type();
+    if (geom_type && *geom_type == mapnik::datasource::Point) {
+        cluster_size = cluster_size_;
+    }
+
+    // Keep the number of tile downloads per query within budget by
+    // falling back to lower zooms, and clipping around the center of the
+    // query if even minzoom needs too many. Clustering stays on the
+    // query's pixel grid either way.
+    tile_range tiles(bb, z, tile_size_);
+    if (max_tiles_ > 0 && tiles.count() > max_tiles_) {
+        std::size_t wanted = tiles.count();
+        while (tiles.count() > max_tiles_ && tiles.zoom > minzoom_) {
+            tiles = tile_range(bb, tiles.zoom - 1, tile_size_);
+        }
+        tiles.clip(max_tiles_);
+        std::clog << "JIT Plugin: query needs " << wanted << " tiles at zoom "
+                  << z << ", over the max_tiles budget of " << max_tiles_
+                  << "; fetching " << tiles.count() << " tiles at zoom "
+                  << tiles.zoom << " instead\n";
+    }
+
+    // passed transformed bbox (WGS84) and tile range
+    return boost::make_shared<jit_featureset>(bb, tiles, tileurl_template_, desc_.get_encoding(),
+        filter_, cluster_size, query_z,
+        overzoomed ? tile_cache_.get() : 0, overzoomed, pipeline_depth_, hedge_,
+        max_retries_);
 }
 
 mapnik::featureset_ptr
@@ -4,7 +4,13 @@
 // mapnik
 #include <mapnik/datasource.hpp>
 
-const std::string MERCATOR_PROJ4 = "+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0.0 +k=1.0 +units=m +nadgrids=@null +wktext +no_defs +over";
+// boost
+#include <boost/shared_ptr.hpp>
+
+#include "hedge_policy.hpp"
+#include "jit_filter.hpp"
+#include "tile_url.hpp"
+#include "tile_cache.hpp"
 
 class jit_datasource : public mapnik::datasource
 {
@@ -32,9 +38,20 @@ private:
     mutable mapnik::layer_descriptor desc_;
     mutable std::string url_;
     mutable std::string tileurl_;
+    mutable mapnik::tile_url_template tileurl_template_;
     mutable std::string thisurl_;
     mutable int minzoom_;
     mutable int maxzoom_;
+    mutable int tile_size_;
+    int cluster_size_;
+    std::size_t max_tiles_;
+    int zoom_offset_;
+    bool overzoom_;
+    int pipeline_depth_;
+    mapnik::hedge_options hedge_;
+    int max_retries_;
+    boost::shared_ptr<mapnik::tile_cache> tile_cache_;
+    jit_filter filter_;
     mutable mapnik::box2d<double> extent_;
 };
 
@@ -25,9 +25,14 @@
 #include <mapnik/util/geometry_to_wkt.hpp>
 #include "spherical_mercator.hpp"
 #include "downloader.hpp"
+#include "tile_url.hpp"
+#include "tile_cache.hpp"
 
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
 // boost
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
@@ -78,7 +83,14 @@ static int gj_end_map(void * ctx) {
         (cs->state == parser_in_geometry)) {
         cs->state = parser_in_feature;
     } else if (cs->state == parser_in_feature) {
-        if (cs->geometry_type == "Point") {
+        // A required filter term whose property never showed up can't
+        // match.
+        if (cs->filter && cs->matched < cs->filter->required()) {
+            cs->skip = true;
+        }
+        if (cs->skip) {
+            // geometry was never collected, nothing to build
+        } else if (cs->geometry_type == "Point") {
             mapnik::geometry_type * pt;
             pt = new mapnik::geometry_type(mapnik::Point);
 #ifdef MAPNIK_DEBUG
@@ -150,7 +162,11 @@ static int gj_end_map(void * ctx) {
 
 static int gj_null(void * ctx) {
     pstate *cs = static_cast<pstate*>(ctx);
-    if (cs->state == parser_in_properties) {
+    if (cs->state == parser_in_properties && !cs->skip) {
+        if (cs->filter && !cs->filter->test_null(cs->property_name)) {
+            cs->skip = true;
+            return 1;
+        }
         cs->feature->put_new(cs->property_name, mapnik::value_null());
     }
     return 1;
@@ -158,7 +174,12 @@ static int gj_null(void * ctx) {
 
 static int gj_boolean(void * ctx, int x) {
     pstate *cs = static_cast<pstate*>(ctx);
-    if (cs->state == parser_in_properties) {
+    if (cs->state == parser_in_properties && !cs->skip) {
+        if (cs->filter &&
+            !cs->filter->test_number(cs->property_name, x, cs->matched)) {
+            cs->skip = true;
+            return 1;
+        }
         cs->feature->put_new(cs->property_name, x);
     }
     return 1;
@@ -166,17 +187,31 @@ static int gj_boolean(void * ctx, int x) {
 
 static int gj_number(void * ctx, const char* str, size_t t) {
     pstate *cs = static_cast<pstate*>(ctx);
+    // Abandoned features don't need their coordinates or properties.
+    if (cs->skip) {
+        return 1;
+    }
     double x = strtod(str, NULL);
 
     if (cs->state == parser_in_coordinates) {
-        if (cs->coord_dimensions == 1) {
-            cs->point_cache.at(0).push_back(x);
-        } else if (cs->coord_dimensions == 2) {
-            cs->point_cache.at(0).push_back(x);
-        } else if (cs->coord_dimensions == 3) {
-            cs->point_cache.back().push_back(x);
+        // numbers outside a coordinate array (e.g. "coordinates": 5)
+        // have no slot to go into
+        if (cs->coord_dimensions < 1 || cs->coord_dimensions > 3) {
+            return 1;
         }
+        std::vector<double> & coords = (cs->coord_dimensions == 3) ?
+            cs->point_cache.back() : cs->point_cache.at(0);
+        // even slots hold longitudes; move wrapped tiles into place
+        if (coords.size() % 2 == 0) {
+            x += cs->x_shift;
+        }
+        coords.push_back(x);
     } else if (cs->state == parser_in_properties) {
+        if (cs->filter &&
+            !cs->filter->test_number(cs->property_name, x, cs->matched)) {
+            cs->skip = true;
+            return 1;
+        }
         cs->feature->put_new(cs->property_name, x);
     }
     return 1;
@@ -184,6 +219,14 @@ static int gj_number(void * ctx, const char* str, size_t t) {
 
 static int gj_string(void * ctx, const unsigned char* str, size_t t) {
     pstate *cs = static_cast<pstate*>(ctx);
+    if (cs->state == parser_in_properties && cs->filter && !cs->skip &&
+        !cs->filter->test_string(cs->property_name, (const char*) str, t,
+                                 cs->matched)) {
+        cs->skip = true;
+    }
+    if (cs->skip && cs->state != parser_in_type) {
+        return 1;
+    }
     std::string str_ = std::string((const char*) str, t);
     if (cs->state == parser_in_type) {
         cs->geometry_type = str_;
@@ -198,7 +241,7 @@ static int gj_start_array(void * ctx) {
     pstate *cs = static_cast<pstate*>(ctx);
     if (cs->state == parser_in_coordinates) {
         cs->coord_dimensions++;
-        if (cs->coord_dimensions == 1) {
+        if (cs->coord_dimensions == 1 && !cs->skip) {
             std::vector <double> sub_cache;
             cs->point_cache.push_back(sub_cache);
         }
@@ -233,10 +276,73 @@ static yajl_callbacks callbacks = {
     gj_end_array
 };
 
+tile_range::tile_range(mapnik::box2d<double> const& box, int z, int size)
+    : zoom(z),
+      tile_size(size)
+{
+    // Work in fractional tile coordinates so tile edges are exact
+    // integers: a bbox ending on a tile boundary doesn't pull in the
+    // neighbouring tile, and negative pixels don't truncate towards zero.
+    const double max_lat = 85.0511287798066;
+    const double n = std::ldexp(1.0, z);
+    double lat0 = std::min(std::max(box.maxy(), -max_lat), max_lat);
+    double lat1 = std::min(std::max(box.miny(), -max_lat), max_lat);
+    double x0 = (box.minx() + 180.0) / 360.0 * n;
+    double x1 = (box.maxx() + 180.0) / 360.0 * n;
+    double y0 = (1.0 - std::log(std::tan(lat0 * DEG_TO_RAD) +
+        1.0 / std::cos(lat0 * DEG_TO_RAD)) / M_PI) / 2.0 * n;
+    double y1 = (1.0 - std::log(std::tan(lat1 * DEG_TO_RAD) +
+        1.0 / std::cos(lat1 * DEG_TO_RAD)) / M_PI) / 2.0 * n;
+
+    // Rows are clamped to the world; columns wrap, and are resolved to
+    // real tiles when the featureset enumerates them.
+    const int tiles = 1 << z;
+    minx = int(std::floor(x0));
+    maxx = int(std::ceil(x1));
+    miny = std::max(0, int(std::floor(y0)));
+    maxy = std::min(tiles, int(std::ceil(y1)));
+    // a zero-width box still touches the tile it sits in
+    if (maxx == minx) ++maxx;
+    if (maxy == miny && miny < tiles) ++maxy;
+}
+
+std::size_t tile_range::count() const
+{
+    if (maxx <= minx || maxy <= miny) return 0;
+    return std::size_t(maxx - minx) * std::size_t(maxy - miny);
+}
+
+void tile_range::clip(std::size_t max_tiles)
+{
+    if (max_tiles == 0) max_tiles = 1;
+    bool front = true;
+    while (count() > max_tiles)
+    {
+        if (maxx - minx >= maxy - miny)
+        {
+            if (front) ++minx; else --maxx;
+        }
+        else
+        {
+            if (front) ++miny; else --maxy;
+        }
+        front = !front;
+    }
+}
+
 jit_featureset::jit_featureset(
-    mapnik::box2d<double> const& bbox, int zoom,
-    std::string const& tileurl,
-    std::string const& encoding)
+    mapnik::box2d<double> const& bbox,
+    tile_range const& tiles,
+    mapnik::tile_url_template const& tileurl,
+    std::string const& encoding,
+    jit_filter const& filter,
+    int cluster_size,
+    int cluster_zoom,
+    mapnik::tile_cache * cache,
+    bool clip,
+    int pipeline_depth,
+    mapnik::hedge_options const& hedge,
+    int max_retries)
     : box_(bbox),
       feature_id_(1),
       tr_(new mapnik::transcoder(encoding)),
@@ -248,78 +354,111 @@ jit_featureset::jit_featureset(
     // std::clog << "JIT Plugin: unbuffered bbox: " << bb << std::endl;
 #endif
 
-    mapnik::spherical_mercator<> merc;
-    
-    double x0 = bbox.minx();
-    double y0 = bbox.maxy();
-    double x1 = bbox.maxx();
-    double y1 = bbox.miny();
-    
-    merc.to_pixels(x0,y0,zoom);    
-    merc.to_pixels(x1,y1,zoom);
-
-    const double tile_size = 256.0;
-    int minx = int(x0/tile_size);
-    int maxx = int(x1/tile_size) + 1;
-    int miny = int(y0/tile_size);
-    int maxy = int(y1/tile_size) + 1;
+    const int zoom = tiles.zoom;
+    const int minx = tiles.minx;
+    const int maxx = tiles.maxx;
+    const int miny = tiles.miny;
+    const int maxy = tiles.maxy;
     std::cerr << minx << "<->" << maxx << "  " << miny <<"<->" << maxy << std::endl;    
     
-    std::vector<std::string> json_input;
-    int count=0;
+    // Columns outside [0, 2^zoom) wrap onto real tiles one world width
+    // away. Each distinct tile is fetched once into a slot; placements
+    // record every (slot, longitude shift) it has to be drawn at.
+    const int world = 1 << zoom;
+    std::vector<std::pair<int, int> > slots;
+    std::map<std::pair<int, int>, std::size_t> slot_index;
+    std::vector<std::pair<std::size_t, double> > placements;
+    for ( int x = minx; x < maxx; ++x)
+    {
+        int wrapped = ((x % world) + world) % world;
+        double shift = double((x - wrapped) / world) * 360.0;
+        for (int y = miny; y < maxy; ++y)
+        {
+            std::pair<int, int> key(wrapped, y);
+            std::map<std::pair<int, int>, std::size_t>::const_iterator itr =
+                slot_index.find(key);
+            std::size_t slot;
+            if (itr == slot_index.end())
+            {
+                slot = slots.size();
+                slot_index[key] = slot;
+                slots.push_back(key);
+            }
+            else
+            {
+                slot = itr->second;
+            }
+            placements.push_back(std::make_pair(slot, shift));
+        }
+    }
+
+    std::vector<std::string> json_input(slots.size());
+    mapnik::tile_downloader::mapped_files mapped(slots.size());
+    std::vector<bool> from_cache(slots.size(), false);
+    std::string url_buffer;
+    if (cache)
+    {
+        for (std::size_t i = 0; i < slots.size(); ++i)
+        {
+            from_cache[i] = cache->find(zoom, slots[i].first, slots[i].second,
+                                        json_input[i]);
+        }
+    }
 #if 1
     {
-        mapnik::tile_downloader downloader(json_input); // RAII
-        for ( int x = minx; x < maxx; ++x)
+        mapnik::tile_downloader downloader(json_input, pipeline_depth, &mapped, hedge,
+                                            max_retries); // RAII
+        for (std::size_t i = 0; i < slots.size(); ++i)
         {
-            for (int y = miny; y < maxy; ++y)
-            {               
-                std::string url = boost::replace_all_copy(
-                    boost::replace_all_copy(boost::replace_all_copy(tileurl,
-                    "{z}", boost::lexical_cast<std::string>(zoom)),
-                    "{x}", boost::lexical_cast<std::string>(x)),
-                    "{y}", boost::lexical_cast<std::string>(y));
-                downloader.push(boost::protect(boost::bind(&mapnik::download_handler::sync_start, _1, url)));
-                ++count;
-            }        
+            if (from_cache[i]) continue;
+            urdl::url url = tileurl.make_url(zoom, slots[i].first, slots[i].second, url_buffer);
+            downloader.push(url, i);
         }
     }
 
 #else
     
     {
-        for ( int x = minx; x < maxx; ++x)
+        for (std::size_t i = 0; i < slots.size(); ++i)
         {
-            for (int y = miny; y < maxy; ++y)
-            {               
-                std::string url = boost::replace_all_copy(
-                    boost::replace_all_copy(boost::replace_all_copy(tileurl,
-                    "{z}", boost::lexical_cast<std::string>(zoom)),
-                    "{x}", boost::lexical_cast<std::string>(x)),
-                    "{y}", boost::lexical_cast<std::string>(y));
-                std::cerr << url << std::endl;
-                urdl::istream is(url);
-                if (is)
-                {
-                    std::stringstream buffer;
-                    buffer << is.rdbuf();
-                    json_input.push_back(buffer.str());
-                }
-                ++count;
-            }        
+            if (from_cache[i]) continue;
+            urdl::url url = tileurl.make_url(zoom, slots[i].first, slots[i].second, url_buffer);
+            std::cerr << url.to_string() << std::endl;
+            urdl::istream is(url);
+            if (is)
+            {
+                is.buffer_size(64 * 1024);
+                is.read_content(json_input[i]);
+            }
         }
     }
 #endif    
     
+    if (cache)
+    {
+        for (std::size_t i = 0; i < slots.size(); ++i)
+        {
+            if (!from_cache[i] && !json_input[i].empty())
+            {
+                cache->insert(zoom, slots[i].first, slots[i].second, json_input[i]);
+            }
+        }
+    }
+    
     mapnik::context_ptr ctx=boost::make_shared<mapnik::context_type>();
     
     
-    BOOST_FOREACH ( std::string const& input_string, json_input)
+    for (std::size_t p = 0; p < placements.size(); ++p)
     {
+        // file:// tiles are parsed straight out of their mapping
+        std::size_t slot = placements[p].first;
+        const char * input = mapped[slot] ? mapped[slot]->data() : json_input[slot].data();
+        std::size_t input_length = mapped[slot] ? mapped[slot]->size() : json_input[slot].size();
         pstate state_bundle;
         
         state_bundle.state = parser_outside;
         state_bundle.done = 0;
+        state_bundle.x_shift = placements[p].second;
         
         hand = yajl_alloc(
             &callbacks, NULL,
@@ -329,17 +468,21 @@ jit_featureset::jit_featureset(
         yajl_config(hand, yajl_allow_trailing_garbage, 1);
         mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx,feature_id_));
         state_bundle.feature = feature;
+        if (!filter.empty())
+        {
+            state_bundle.filter = &filter;
+        }
         
-        for ( int itt = 0; itt < input_string.length(); ++itt) 
+        for ( std::size_t itt = 0; itt < input_length; ++itt) 
         {            
             int parse_result = yajl_parse(hand,
-                                      (const unsigned char *)&input_string[itt], 1);
+                                      (const unsigned char *)&input[itt], 1);
             
             if (parse_result == yajl_status_error) 
             {
                 unsigned char *str = yajl_get_error(hand,
-                                                    1,  (const unsigned char*) input_string.c_str(),
-                                                    input_string.length());
+                                                    1,  (const unsigned char*) input,
+                                                    input_length);
                 std::ostringstream errmsg;
                 errmsg << "GeoJSON Plugin: invalid GeoJSON detected: " << (const char*) str << "\n";
                 yajl_free_error(hand, str);
@@ -347,25 +490,144 @@ jit_featureset::jit_featureset(
             } 
             else if (state_bundle.done == 1) 
             {
-                features_.push_back(state_bundle.feature);
-                mapnik::feature_ptr
-                    feature(mapnik::feature_factory::create(ctx,feature_id_++));        
+                // Overzoomed tiles cover far more than the query; leave
+                // out what can't be drawn.
+                if (clip && !state_bundle.skip &&
+                    !state_bundle.feature->envelope().intersects(box_))
+                {
+                    state_bundle.skip = true;
+                }
+                if (!state_bundle.skip)
+                {
+                    features_.push_back(state_bundle.feature);
+                    mapnik::feature_ptr
+                        feature(mapnik::feature_factory::create(ctx,feature_id_++));        
+                    state_bundle.feature = feature;
+                }
+                else
+                {
+                    // drop properties that arrived before the filter failed
+                    state_bundle.feature = mapnik::feature_factory::create(ctx,feature_id_);
+                }
                 // reset
                 state_bundle.point_cache.clear();
                 state_bundle.done = 0;
                 state_bundle.geometry_type = "";
-                state_bundle.feature = feature;
+                state_bundle.skip = false;
+                state_bundle.matched = 0;
             }
         }
         std::cerr << "SIZE = " << features_.size() << std::endl;
         yajl_free(hand);
     }
     
+    if (cluster_size > 0)
+    {
+        cluster_points(ctx, cluster_zoom, tiles.tile_size, cluster_size);
+    }
     
     feature_id_ = 0;
 
 }
 
+namespace {
+
+struct point_cluster
+{
+    double sum_x;
+    double sum_y;
+    int count;
+    std::map<std::string, double> sums;
+    point_cluster() : sum_x(0), sum_y(0), count(0), sums() {}
+};
+
+}
+
+// Collapse point features onto a grid of cluster_size pixels at the
+// query zoom, which may be finer than the zoom the tiles came from. Each
+// cell becomes one feature placed at the mean position of its members,
+// carrying a point_count and the sum of every numeric property seen in
+// the cell.
+void jit_featureset::cluster_points(mapnik::context_ptr const& ctx,
+                                    int zoom, int tile_size, int cluster_size)
+{
+    mapnik::spherical_mercator<> merc(tile_size);
+    // past max_zoom a pixel is well under a millimetre anyway
+    zoom = std::min(zoom, int(mapnik::spherical_mercator<>::max_zoom));
+    std::map<std::pair<int, int>, point_cluster> grid;
+
+    // Gather the points first so they can be projected in one batch.
+    std::vector<mapnik::feature_ptr> points;
+    std::vector<double> lonlat;
+    points.reserve(features_.size());
+    lonlat.reserve(features_.size() * 2);
+    BOOST_FOREACH ( mapnik::feature_ptr const& feature, features_)
+    {
+        if (feature->num_geometries() == 0) continue;
+        mapnik::geometry_type const& geom = feature->get_geometry(0);
+        if (geom.type() != mapnik::Point) continue;
+
+        double x, y;
+        geom.rewind(0);
+        geom.vertex(&x, &y);
+        points.push_back(feature);
+        lonlat.push_back(x);
+        lonlat.push_back(y);
+    }
+    if (points.empty()) return;
+
+    std::vector<double> pixels(lonlat);
+    if (!merc.to_pixels(&pixels[0], points.size(), zoom)) return;
+
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+        mapnik::feature_ptr const& feature = points[i];
+        std::pair<int, int> cell(int(std::floor(pixels[2 * i] / cluster_size)),
+                                 int(std::floor(pixels[2 * i + 1] / cluster_size)));
+
+        point_cluster & cluster = grid[cell];
+        cluster.sum_x += lonlat[2 * i];
+        cluster.sum_y += lonlat[2 * i + 1];
+        ++cluster.count;
+
+        for (mapnik::feature_impl::iterator itr = feature->begin();
+             itr != feature->end(); ++itr)
+        {
+            double const* num = boost::get<double>(&boost::get<1>(*itr).base());
+            if (num)
+            {
+                cluster.sums[boost::get<0>(*itr)] += *num;
+            }
+        }
+    }
+
+    std::vector<mapnik::feature_ptr> clustered;
+    clustered.reserve(grid.size());
+    unsigned id = 1;
+    std::map<std::pair<int, int>, point_cluster>::const_iterator itr = grid.begin();
+    for (; itr != grid.end(); ++itr)
+    {
+        point_cluster const& cluster = itr->second;
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, id++));
+        mapnik::geometry_type * pt = new mapnik::geometry_type(mapnik::Point);
+        pt->move_to(cluster.sum_x / cluster.count, cluster.sum_y / cluster.count);
+        feature->add_geometry(pt);
+        feature->put_new("point_count", cluster.count);
+
+        std::map<std::string, double>::const_iterator sum = cluster.sums.begin();
+        for (; sum != cluster.sums.end(); ++sum)
+        {
+            feature->put_new(sum->first, sum->second);
+        }
+        clustered.push_back(feature);
+    }
+#ifdef MAPNIK_DEBUG
+    std::clog << "JIT Plugin: clustered " << features_.size() << " points into "
+              << clustered.size() << " features" << std::endl;
+#endif
+    features_.swap(clustered);
+}
+
 jit_featureset::~jit_featureset() { }
 
 mapnik::feature_ptr jit_featureset::next() {
@@ -6,6 +6,11 @@
 #include <boost/scoped_ptr.hpp>
 #include <vector>
 
+#include "hedge_policy.hpp"
+#include "jit_filter.hpp"
+#include "tile_url.hpp"
+#include "tile_cache.hpp"
+
 enum parser_state {
     parser_outside,
     parser_in_featurecollection,
@@ -27,6 +32,12 @@ struct pstate {
     boost::scoped_ptr<mapnik::transcoder> tr;
     std::vector< std::vector<double> > point_cache;
     parser_state state;
+    // pushdown filter, null when every feature is wanted
+    jit_filter const* filter;
+    bool skip;
+    std::size_t matched;
+    // added to longitudes of tiles wrapped across the antimeridian
+    double x_shift;
     pstate() :
         done(0),
         coord_dimensions(0),
@@ -35,20 +46,52 @@ struct pstate {
         feature(),
         tr(new mapnik::transcoder("utf-8")),
         point_cache(),
-        state()
+        state(),
+        filter(0),
+        skip(false),
+        matched(0),
+        x_shift(0)
     { }
 };
 
+// Half-open range of tile columns [minx, maxx) and rows [miny, maxy)
+// covering a WGS84 bbox at one zoom level. Columns are not wrapped, so
+// they can fall outside [0, 2^zoom) for boxes past the antimeridian.
+struct tile_range {
+    int zoom;
+    int tile_size;
+    int minx;
+    int maxx;
+    int miny;
+    int maxy;
+    tile_range(mapnik::box2d<double> const& box, int z, int size = 256);
+    std::size_t count() const;
+    // Shrink towards the center until at most max_tiles remain.
+    void clip(std::size_t max_tiles);
+};
+
 class jit_featureset : public mapnik::Featureset
 {
 public:
     jit_featureset(mapnik::box2d<double> const& box,
-                   int zoom, std::string const& url,
-                   std::string const& encoding);
+                   tile_range const& tiles,
+                   mapnik::tile_url_template const& url,
+                   std::string const& encoding,
+                   jit_filter const& filter,
+                   int cluster_size = 0,
+                   int cluster_zoom = 0,
+                   mapnik::tile_cache * cache = 0,
+                   bool clip = false,
+                   int pipeline_depth = 1,
+                   mapnik::hedge_options const& hedge = mapnik::hedge_options(),
+                   int max_retries = 0);
     virtual ~jit_featureset();
     mapnik::feature_ptr next();
 
 private:
+    void cluster_points(mapnik::context_ptr const& ctx,
+                        int zoom, int tile_size, int cluster_size);
+
     mapnik::box2d<double> box_;
     mutable unsigned int feature_id_;
     mutable std::string input_string_;
@@ -0,0 +1,254 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+// mapnik
+#include <mapnik/datasource.hpp>
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include "jit_filter.hpp"
+
+namespace {
+
+struct filter_parser
+{
+    std::string const& s;
+    std::size_t pos;
+
+    explicit filter_parser(std::string const& str) : s(str), pos(0) {}
+
+    void fail(const char* what) const
+    {
+        std::ostringstream msg;
+        msg << "JIT Plugin: invalid filter, " << what
+            << " at position " << pos << " in '" << s << "'";
+        throw mapnik::datasource_exception(msg.str());
+    }
+
+    void skip_ws()
+    {
+        while (pos < s.size() && std::isspace(s[pos])) ++pos;
+    }
+
+    bool at_end()
+    {
+        skip_ws();
+        return pos >= s.size();
+    }
+
+    bool accept(const char* tok)
+    {
+        skip_ws();
+        std::size_t len = std::strlen(tok);
+        if (s.compare(pos, len, tok) == 0)
+        {
+            pos += len;
+            return true;
+        }
+        return false;
+    }
+
+    // Case-insensitive keyword that must not run into an identifier.
+    bool accept_keyword(const char* kw)
+    {
+        skip_ws();
+        std::size_t len = std::strlen(kw);
+        if (pos + len > s.size()) return false;
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            if (std::tolower(s[pos + i]) != kw[i]) return false;
+        }
+        if (pos + len < s.size() &&
+            (std::isalnum(s[pos + len]) || s[pos + len] == '_'))
+        {
+            return false;
+        }
+        pos += len;
+        return true;
+    }
+
+    std::string property()
+    {
+        if (!accept("[")) fail("expected '['");
+        std::size_t end = s.find(']', pos);
+        if (end == std::string::npos) fail("unterminated property name");
+        std::string name = s.substr(pos, end - pos);
+        pos = end + 1;
+        return name;
+    }
+
+    jit_filter::operand value()
+    {
+        jit_filter::operand v;
+        skip_ws();
+        if (pos < s.size() && (s[pos] == '\'' || s[pos] == '"'))
+        {
+            char quote = s[pos++];
+            std::size_t end = s.find(quote, pos);
+            if (end == std::string::npos) fail("unterminated string");
+            v.numeric = false;
+            v.number = 0;
+            v.str = s.substr(pos, end - pos);
+            pos = end + 1;
+            return v;
+        }
+        const char* begin = s.c_str() + pos;
+        char* end = 0;
+        v.number = std::strtod(begin, &end);
+        if (end == begin) fail("expected a number or quoted string");
+        v.numeric = true;
+        pos += end - begin;
+        return v;
+    }
+
+    jit_filter::term parse_term()
+    {
+        jit_filter::term t;
+        t.property = property();
+        if (accept_keyword("in"))
+        {
+            t.op = jit_filter::op_in;
+            if (!accept("(")) fail("expected '('");
+            do
+            {
+                t.operands.push_back(value());
+            }
+            while (accept(","));
+            if (!accept(")")) fail("expected ')'");
+            return t;
+        }
+        // longest operators first
+        if (accept("!=") || accept("<>")) t.op = jit_filter::op_ne;
+        else if (accept("<=")) t.op = jit_filter::op_le;
+        else if (accept(">=")) t.op = jit_filter::op_ge;
+        else if (accept("=")) t.op = jit_filter::op_eq;
+        else if (accept("<")) t.op = jit_filter::op_lt;
+        else if (accept(">")) t.op = jit_filter::op_gt;
+        else fail("expected a comparison operator");
+        t.operands.push_back(value());
+        if (t.op != jit_filter::op_eq && t.op != jit_filter::op_ne &&
+            !t.operands.back().numeric)
+        {
+            fail("range comparisons need a numeric value");
+        }
+        return t;
+    }
+};
+
+bool compare_number(jit_filter::op_t op, double lhs, double rhs)
+{
+    switch (op)
+    {
+    case jit_filter::op_eq:
+    case jit_filter::op_in: return lhs == rhs;
+    case jit_filter::op_ne: return lhs != rhs;
+    case jit_filter::op_lt: return lhs < rhs;
+    case jit_filter::op_le: return lhs <= rhs;
+    case jit_filter::op_gt: return lhs > rhs;
+    case jit_filter::op_ge: return lhs >= rhs;
+    }
+    return false;
+}
+
+}
+
+jit_filter::jit_filter()
+    : terms_(),
+      required_(0) {}
+
+jit_filter::jit_filter(std::string const& expr)
+    : terms_(),
+      required_(0)
+{
+    filter_parser p(expr);
+    if (p.at_end()) return;
+    do
+    {
+        terms_.push_back(p.parse_term());
+        if (terms_.back().op != op_ne) ++required_;
+    }
+    while (p.accept_keyword("and"));
+    if (!p.at_end()) p.fail("unexpected input");
+}
+
+bool jit_filter::test_string(std::string const& property,
+                             const char* str, std::size_t len,
+                             std::size_t & matched) const
+{
+    std::vector<term>::const_iterator t = terms_.begin();
+    for (; t != terms_.end(); ++t)
+    {
+        if (t->property != property) continue;
+        bool any = false;
+        std::vector<operand>::const_iterator o = t->operands.begin();
+        for (; o != t->operands.end() && !any; ++o)
+        {
+            any = !o->numeric && o->str.size() == len &&
+                std::memcmp(o->str.data(), str, len) == 0;
+        }
+        bool ok = (t->op == op_ne) ? !any : any;
+        if (!ok) return false;
+        if (t->op != op_ne) ++matched;
+    }
+    return true;
+}
+
+bool jit_filter::test_number(std::string const& property, double x,
+                             std::size_t & matched) const
+{
+    std::vector<term>::const_iterator t = terms_.begin();
+    for (; t != terms_.end(); ++t)
+    {
+        if (t->property != property) continue;
+        bool ok = false;
+        if (t->op == op_ne)
+        {
+            ok = !t->operands[0].numeric ||
+                compare_number(op_ne, x, t->operands[0].number);
+        }
+        else
+        {
+            std::vector<operand>::const_iterator o = t->operands.begin();
+            for (; o != t->operands.end() && !ok; ++o)
+            {
+                ok = o->numeric && compare_number(t->op, x, o->number);
+            }
+        }
+        if (!ok) return false;
+        if (t->op != op_ne) ++matched;
+    }
+    return true;
+}
+
+bool jit_filter::test_null(std::string const& property) const
+{
+    std::vector<term>::const_iterator t = terms_.begin();
+    for (; t != terms_.end(); ++t)
+    {
+        if (t->property == property && t->op != op_ne) return false;
+    }
+    return true;
+}
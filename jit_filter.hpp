@@ -0,0 +1,68 @@
+#ifndef JIT_FILTER_HPP
+#define JIT_FILTER_HPP
+
+#include <string>
+#include <vector>
+
+// A conjunction of simple property tests that can be evaluated while a
+// feature's properties stream through the GeoJSON parser, so features
+// that can't match are dropped before they are built. Syntax follows
+// mapnik filter expressions, restricted to:
+//
+//   [name] = 'value'   [name] != 5   [name] < 5   (also <=, >, >=)
+//   [name] in ('a', 'b', 3)
+//
+// joined by 'and'.
+//
+// As in mapnik, a null or missing property is unequal to every value, so
+// '!=' terms let it through; every other term needs the property.
+class jit_filter
+{
+public:
+    enum op_t {
+        op_eq,
+        op_ne,
+        op_lt,
+        op_le,
+        op_gt,
+        op_ge,
+        op_in
+    };
+
+    struct operand {
+        bool numeric;
+        double number;
+        std::string str;
+    };
+
+    struct term {
+        std::string property;
+        op_t op;
+        std::vector<operand> operands;
+    };
+
+    jit_filter();
+    // throws mapnik::datasource_exception on malformed input
+    explicit jit_filter(std::string const& expr);
+
+    bool empty() const { return terms_.empty(); }
+    std::size_t size() const { return terms_.size(); }
+    // number of terms that only a present, non-null property can satisfy
+    std::size_t required() const { return required_; }
+
+    // Each test returns false as soon as a term on the property fails;
+    // `matched` is incremented for each required term it satisfies. A
+    // feature matches when no test failed and matched == required().
+    bool test_string(std::string const& property,
+                     const char* str, std::size_t len,
+                     std::size_t & matched) const;
+    bool test_number(std::string const& property, double x,
+                     std::size_t & matched) const;
+    bool test_null(std::string const& property) const;
+
+private:
+    std::vector<term> terms_;
+    std::size_t required_;
+};
+
+#endif // JIT_FILTER_HPP
@@ -0,0 +1,99 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MAPNIK_MAPPED_FILE_HPP
+#define MAPNIK_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mapnik {
+
+// A local file mapped read-only into memory, so a file:// tile can be
+// parsed in place instead of being copied through a stream. is_open() is
+// false if the file could not be mapped (or on platforms without mmap), in
+// which case the caller falls back to reading it.
+class mapped_file : private boost::noncopyable
+{
+public:
+    explicit mapped_file(std::string const& path)
+        : data_(0), size_(0), open_(false)
+    {
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            size_ = static_cast<std::size_t>(st.st_size);
+            if (size_ == 0)
+            {
+                open_ = true;
+            }
+            else
+            {
+                void * p = ::mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    // tiles are parsed front to back exactly once
+                    ::madvise(p, size_, MADV_SEQUENTIAL);
+                    data_ = static_cast<const char*>(p);
+                    open_ = true;
+                }
+            }
+        }
+        // the mapping holds its own reference to the file
+        ::close(fd);
+#else
+        (void)path;
+#endif
+    }
+
+    ~mapped_file()
+    {
+#if !defined(_WIN32)
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    bool is_open() const { return open_; }
+    const char * data() const { return data_; }
+    std::size_t size() const { return open_ ? size_ : 0; }
+
+private:
+    const char * data_;
+    std::size_t size_;
+    bool open_;
+};
+
+}
+
+#endif // MAPNIK_MAPPED_FILE_HPP
@@ -36,49 +36,261 @@
 #endif
 
 #include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+// Build per-ISA clones of the batch conversions and let the loader pick
+// one for the running CPU. Only GCC on x86-64 Linux does this, and the
+// clones only pay off with optimization on; the plugin's own Makefile
+// (clang++, -O0) gets the single plain loop.
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6) && \
+    defined(__x86_64__) && defined(__linux__)
+#define MAPNIK_MERCATOR_SIMD_DISPATCH \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MAPNIK_MERCATOR_SIMD_DISPATCH
+#endif
 
 namespace mapnik {
 
-template <int levels=19>
+namespace detail {
+
+// Call-free, branch-free stand-ins for the libm functions used by the
+// batch conversions below, so loops over coordinate arrays can be
+// vectorized by the compiler. Each is a range reduction followed by a
+// truncated series; measured against libm over the domains used here,
+// each kernel is within 6e-16 relative.
+
+inline double mercator_bits_to_double(boost::uint64_t bits)
+{
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+inline boost::uint64_t mercator_double_to_bits(double d)
+{
+    boost::uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+// Natural log for positive, normal x.
+inline double mercator_log(double x)
+{
+    const double sqrt2 = 1.41421356237309504880;
+    const double ln2 = 0.69314718055994530942;
+    const double two52 = 4503599627370496.0;
+    boost::uint64_t bits = mercator_double_to_bits(x);
+    // exponent to double without an int conversion, which SSE2/AVX2
+    // can't do for 64-bit lanes
+    double e = mercator_bits_to_double(
+        ((bits >> 52) & 0x7ff) | 0x4330000000000000ULL) - two52 - 1023.0;
+    // mantissa in [1, 2), then folded to [sqrt(1/2), sqrt(2))
+    double m = mercator_bits_to_double(
+        (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    double big = (m > sqrt2) ? 1.0 : 0.0;
+    m *= 1.0 - 0.5 * big;
+    e += big;
+    // log(m) = 2 atanh(s), |s| <= 0.1716
+    double s = (m - 1.0) / (m + 1.0);
+    double s2 = s * s;
+    double p = 1.0 / 21;
+    p = p * s2 + 1.0 / 19;
+    p = p * s2 + 1.0 / 17;
+    p = p * s2 + 1.0 / 15;
+    p = p * s2 + 1.0 / 13;
+    p = p * s2 + 1.0 / 11;
+    p = p * s2 + 1.0 / 9;
+    p = p * s2 + 1.0 / 7;
+    p = p * s2 + 1.0 / 5;
+    p = p * s2 + 1.0 / 3;
+    p = p * s2 + 1.0;
+    return e * ln2 + 2.0 * s * p;
+}
+
+// e^x for |x| <= 700.
+inline double mercator_exp(double x)
+{
+    // ln2 split in two so k * ln2_hi is exact
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    const double log2e = 1.44269504088896340736;
+    double k = std::floor(x * log2e + 0.5);
+    double r = (x - k * ln2_hi) - k * ln2_lo;  // |r| <= ln2 / 2
+    double p = 1.0 / 6227020800.0;         // 1/13!
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    // 2^k built from the low bits of k + 1023 + 2^52
+    const double two52 = 4503599627370496.0;
+    boost::uint64_t scale =
+        (mercator_double_to_bits(k + 1023.0 + two52) & 0x7ff) << 52;
+    return p * mercator_bits_to_double(scale);
+}
+
+// sin(x) for |x| <= pi/2.
+inline double mercator_sin(double x)
+{
+    double x2 = x * x;
+    double p = 1.0 / 51090942171709440000.0;  // 1/21!
+    p = p * x2 - 1.0 / 121645100408832000.0;
+    p = p * x2 + 1.0 / 355687428096000.0;
+    p = p * x2 - 1.0 / 1307674368000.0;
+    p = p * x2 + 1.0 / 6227020800.0;
+    p = p * x2 - 1.0 / 39916800.0;
+    p = p * x2 + 1.0 / 362880.0;
+    p = p * x2 - 1.0 / 5040.0;
+    p = p * x2 + 1.0 / 120.0;
+    p = p * x2 - 1.0 / 6.0;
+    p = p * x2 + 1.0;
+    return x * p;
+}
+
+// round() (half away from zero) without the libm call.
+inline double mercator_round(double x)
+{
+    return (x < 0) ? -std::floor(0.5 - x) : std::floor(x + 0.5);
+}
+
+// atan(t) for 0 <= t <= 1.
+inline double mercator_atan(double t)
+{
+    const double pi_4 = 0.78539816339744830962;
+    const double tan_pi_8 = 0.41421356237309504880;
+    // above tan(pi/8) use atan(t) = pi/4 + atan((t - 1) / (t + 1))
+    double hi = (t > tan_pi_8) ? 1.0 : 0.0;
+    double u = hi * ((t - 1.0) / (t + 1.0)) + (1.0 - hi) * t;
+    // |u| <= tan(pi/8); a second halving, atan(u) = 2 atan(v) with
+    // v = u / (1 + sqrt(1 + u^2)), brings it under 0.199
+    double v = u / (1.0 + std::sqrt(1.0 + u * u));
+    double v2 = v * v;
+    double p = -1.0 / 23;
+    p = p * v2 + 1.0 / 21;
+    p = p * v2 - 1.0 / 19;
+    p = p * v2 + 1.0 / 17;
+    p = p * v2 - 1.0 / 15;
+    p = p * v2 + 1.0 / 13;
+    p = p * v2 - 1.0 / 11;
+    p = p * v2 + 1.0 / 9;
+    p = p * v2 - 1.0 / 7;
+    p = p * v2 + 1.0 / 5;
+    p = p * v2 - 1.0 / 3;
+    p = p * v2 + 1.0;
+    return hi * pi_4 + 2.0 * v * p;
+}
+
+}
+
+// Pixel coordinates of a web mercator tile pyramid. The per-zoom
+// constants are all powers of two times the tile size, so they are
+// computed on demand (ldexp only adjusts the exponent) rather than kept
+// in tables: construction is free, every zoom from 0 to max_zoom works,
+// and nothing overflows at deep zooms.
+template <int TileSize = 256>
 class spherical_mercator
 {
-    double Ac[levels];
-    double Bc[levels];
-    double Cc[levels];
-    double zc[levels];
+    double tile_size_;
     
 public:
-    spherical_mercator() 
-    {    
-        int d, c = 256;
-        for (d=0; d<levels; d++) {
-            int e = c/2;
-            Bc[d] = c/360.0;
-            Cc[d] = c/(2 * M_PI);
-            zc[d] = e;
-            Ac[d] = c;
-            c *=2;
-        }
-    }
+    static const int max_zoom = 30;
+
+    explicit spherical_mercator(int tile_size = TileSize) 
+        : tile_size_(tile_size) {}
     
-    void to_pixels(double &x, double &y, int zoom) 
+    // Returns false, leaving x and y untouched, for zooms outside
+    // [0, max_zoom].
+    bool to_pixels(double &x, double &y, int zoom) const
     {
-        double d = zc[zoom];
+        if (zoom < 0 || zoom > max_zoom) return false;
+        double c = std::ldexp(tile_size_, zoom);
+        double d = c / 2;
         double f = minmax(std::sin(DEG_TO_RAD * y),-0.9999,0.9999);
-        x = round(d + x * Bc[zoom]);
-        y = round(d + 0.5*std::log((1+f)/(1-f))*-Cc[zoom]);
+        x = round(d + x * (c / 360.0));
+        y = round(d + 0.5*std::log((1+f)/(1-f))*-(c / (2 * M_PI)));
+        return true;
     }
     
-    void from_pixels(double &x, double &y, int zoom) 
+    bool from_pixels(double &x, double &y, int zoom) const
     {
-        double e = zc[zoom];
-        double g = (y - e)/-Cc[zoom];
-        x = (x - e)/Bc[zoom];
+        if (zoom < 0 || zoom > max_zoom) return false;
+        double c = std::ldexp(tile_size_, zoom);
+        double e = c / 2;
+        double g = (y - e)/-(c / (2 * M_PI));
+        x = (x - e)/(c / 360.0);
         y = RAD_TO_DEG * ( 2 * atan(exp(g)) - 0.5 * M_PI);
+        return true;
+    }
+
+    // Batch forms of to_pixels and from_pixels over count interleaved
+    // x,y pairs, converted in place. The loop bodies use the detail::
+    // approximations and contain no calls or branches, so they vectorize
+    // when optimized with -fno-math-errno -fno-trapping-math; see
+    // MAPNIK_MERCATOR_SIMD_DISPATCH for when per-ISA versions are built.
+    // Over zooms 0-30, from_pixels latitudes agree with the scalar form
+    // to within 1e-13 degrees, and longitudes exactly; relative latitude
+    // error grows toward the equator, where 2 atan(w) - pi/2 cancels,
+    // to about 5e-12 at 0.001 degrees. to_pixels results can differ
+    // from the scalar form by one pixel when a coordinate falls within
+    // rounding error of a half-pixel boundary. test/spherical_mercator.cpp
+    // checks these bounds.
+    MAPNIK_MERCATOR_SIMD_DISPATCH
+    bool to_pixels(double * xy, std::size_t count, int zoom) const
+    {
+        if (zoom < 0 || zoom > max_zoom) return false;
+        const double c = std::ldexp(tile_size_, zoom);
+        const double d = c / 2;
+        const double bc = c / 360.0;
+        const double cc = c / (2 * M_PI);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            double x = xy[2 * i];
+            double lat = minmax(xy[2 * i + 1], -90.0, 90.0);
+            double f = minmax(detail::mercator_sin(DEG_TO_RAD * lat), -0.9999, 0.9999);
+            xy[2 * i] = detail::mercator_round(d + x * bc);
+            xy[2 * i + 1] = detail::mercator_round(
+                d - 0.5 * detail::mercator_log((1 + f) / (1 - f)) * cc);
+        }
+        return true;
+    }
+
+    MAPNIK_MERCATOR_SIMD_DISPATCH
+    bool from_pixels(double * xy, std::size_t count, int zoom) const
+    {
+        if (zoom < 0 || zoom > max_zoom) return false;
+        const double c = std::ldexp(tile_size_, zoom);
+        const double e = c / 2;
+        const double bc = c / 360.0;
+        const double cc = c / (2 * M_PI);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            double g = minmax((xy[2 * i + 1] - e) / -cc, -700.0, 700.0);
+            double w = detail::mercator_exp(g);
+            // atan(w) = pi/2 - atan(1/w) keeps the kernel in [0, 1]
+            double big = (w > 1.0) ? 1.0 : 0.0;
+            double t = big / w + (1.0 - big) * w;
+            double a = detail::mercator_atan(t);
+            a = big * (0.5 * M_PI - a) + (1.0 - big) * a;
+            xy[2 * i] = (xy[2 * i] - e) / bc;
+            xy[2 * i + 1] = RAD_TO_DEG * (2 * a - 0.5 * M_PI);
+        }
+        return true;
     }
 
 private:
-    double minmax(double a, double b, double c)
+    static double minmax(double a, double b, double c)
     {
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
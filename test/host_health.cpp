@@ -0,0 +1,222 @@
+// Checks the per-host circuit breaker in host_health.hpp on a clock the
+// test moves by hand. Needs boost and the bundled urdl, not mapnik:
+//
+//   make host_health && ./host_health
+
+#include "host_health.hpp"
+
+#include <cstdio>
+
+namespace {
+
+class test_health : public mapnik::host_health
+{
+public:
+    test_health()
+        : now_(boost::gregorian::date(2012, 1, 1)) {}
+
+    void advance(long milliseconds)
+    {
+        now_ += boost::posix_time::milliseconds(milliseconds);
+    }
+
+protected:
+    boost::posix_time::ptime current_time() const
+    {
+        return now_;
+    }
+
+private:
+    boost::posix_time::ptime now_;
+};
+
+typedef mapnik::host_health health;
+
+const std::string host = "tiles.example.com:80";
+
+int failures = 0;
+
+void check(bool ok, const char * what, int line)
+{
+    if (ok) return;
+    std::fprintf(stderr, "FAIL: line %d: %s\n", line, what);
+    ++failures;
+}
+
+#define CHECK(expr) check((expr), #expr, __LINE__)
+
+// Fails requests until the circuit opens, returning the cool-down.
+long open_circuit(test_health & h)
+{
+    bool probe = false;
+    long cooldown = 0;
+    for (int i = 0; i < health::failure_threshold; ++i)
+    {
+        CHECK(h.allow(host, probe));
+        CHECK(!probe);
+        cooldown = h.failure(host);
+        if (i + 1 < health::failure_threshold)
+        {
+            CHECK(cooldown == 0);
+        }
+    }
+    return cooldown;
+}
+
+// The circuit opens at failure_threshold failures in a row, and not
+// before; a success in between starts the count again.
+void threshold_test()
+{
+    test_health h;
+    bool probe = false;
+    for (int i = 0; i + 1 < health::failure_threshold; ++i)
+    {
+        CHECK(h.allow(host, probe));
+        CHECK(h.failure(host) == 0);
+    }
+    CHECK(!h.success(host));
+    CHECK(!h.stats(host).open);
+
+    CHECK(open_circuit(h) == health::min_cooldown_ms);
+    CHECK(h.stats(host).open);
+    CHECK(!h.allow(host, probe));
+    CHECK(!probe);
+    CHECK(h.stats(host).rejected == 1);
+
+    // other hosts are unaffected
+    CHECK(h.allow("other.example.com:80", probe));
+}
+
+// A failed probe doubles the cool-down, up to max_cooldown_ms; a
+// successful one closes the circuit and resets it.
+void cooldown_test()
+{
+    test_health h;
+    long cooldown = open_circuit(h);
+    long expected = health::min_cooldown_ms;
+    bool probe = false;
+    for (int i = 0; i < 8; ++i)
+    {
+        CHECK(cooldown == expected);
+        h.advance(cooldown - 1);
+        CHECK(!h.allow(host, probe));
+        h.advance(1);
+        CHECK(h.allow(host, probe));
+        CHECK(probe);
+        cooldown = h.failure(host);
+        expected = std::min(expected * 2, long(health::max_cooldown_ms));
+    }
+    CHECK(cooldown == health::max_cooldown_ms);
+
+    h.advance(cooldown);
+    CHECK(h.allow(host, probe));
+    CHECK(probe);
+    CHECK(h.success(host));
+    CHECK(!h.stats(host).open);
+    CHECK(open_circuit(h) == health::min_cooldown_ms);
+}
+
+// Only one probe goes at a time. Releasing it lets the next request
+// probe at once; an abandoned probe stops blocking after
+// probe_timeout_ms.
+void probe_test()
+{
+    test_health h;
+    long cooldown = open_circuit(h);
+    h.advance(cooldown);
+
+    bool probe = false;
+    CHECK(h.allow(host, probe));
+    CHECK(probe);
+    CHECK(!h.allow(host, probe));
+    CHECK(!probe);
+    CHECK(h.stats(host).open);
+
+    h.release(host);
+    CHECK(h.stats(host).open);
+    CHECK(h.allow(host, probe));
+    CHECK(probe);
+
+    h.advance(health::probe_timeout_ms - 1);
+    CHECK(!h.allow(host, probe));
+    h.advance(1);
+    CHECK(h.allow(host, probe));
+    CHECK(probe);
+
+    // release() outside a probe changes nothing
+    CHECK(h.success(host));
+    h.release(host);
+    CHECK(!h.stats(host).open);
+    CHECK(h.allow(host, probe));
+    CHECK(!probe);
+}
+
+// Failures of requests already in flight when the circuit opened are
+// counted, but neither re-arm the cool-down nor double it.
+void open_failure_test()
+{
+    test_health h;
+    long cooldown = open_circuit(h);
+    CHECK(h.failure(host) == 0);
+    CHECK(h.failure(host) == 0);
+    CHECK(h.stats(host).failures == std::size_t(health::failure_threshold) + 2);
+
+    bool probe = false;
+    h.advance(cooldown);
+    CHECK(h.allow(host, probe));
+    CHECK(probe);
+    CHECK(h.failure(host) == 2 * health::min_cooldown_ms);
+}
+
+// report() returns the hosts with new failures, retries or rejections,
+// at most once per report_interval_ms.
+void report_test()
+{
+    test_health h;
+    std::map<std::string, mapnik::host_stats> changed;
+    CHECK(!h.report(changed));
+    CHECK(changed.empty());
+
+    bool probe = false;
+    CHECK(h.allow(host, probe));
+    h.failure(host);
+    CHECK(h.allow("quiet.example.com:80", probe));
+    h.success("quiet.example.com:80");
+
+    // too soon after the last report, even with something new
+    CHECK(!h.report(changed));
+    h.advance(health::report_interval_ms - 1);
+    CHECK(!h.report(changed));
+
+    h.advance(1);
+    CHECK(h.report(changed));
+    CHECK(changed.size() == 1);
+    CHECK(changed.count(host) == 1);
+    CHECK(changed[host].failures == 1);
+
+    // nothing new since
+    changed.clear();
+    h.advance(health::report_interval_ms);
+    CHECK(!h.report(changed));
+    CHECK(changed.empty());
+
+    h.retry_delay(host, 1);
+    h.advance(health::report_interval_ms);
+    CHECK(h.report(changed));
+    CHECK(changed[host].retries == 1);
+}
+
+}
+
+int main()
+{
+    threshold_test();
+    cooldown_test();
+    probe_test();
+    open_failure_test();
+    report_test();
+
+    if (failures) return 1;
+    std::printf("host_health: ok\n");
+    return 0;
+}
@@ -5,12 +5,32 @@
 import BaseHTTPServer, json, re
 
 view_json = json.load(open('view.json', 'r'))
+# Point the view's tiles back at this server.
+view_json['vectors'] = 'http://localhost:9000/view/osm.road/{z}/{x}/{y}.geojson'
+
+def road(coordinates, properties):
+    return { "type": "Feature",
+             "geometry": { "type": "LineString", "coordinates": coordinates },
+             "properties": properties }
+
+# Tile 5/16/15 holds a few roads for the filter tests; every other tile
+# is empty.
+fixture_tile = { "type": "FeatureCollection", "features": [
+    road([[1, 1], [2, 2]], { "highway": "primary", "z_order": 5 }),
+    road([[3, 3], [4, 4]], { "highway": "secondary", "z_order": 3 }),
+    road([[5, 5], [6, 6]], { "highway": "residential", "z_order": 1 }),
+    road([[7, 7], [8, 8]], { "highway": None, "z_order": 0 }),
+    road([[9, 9], [10, 10]], { "z_order": -1 })
+] }
 
 def serve_view(s):
     s.wfile.write(json.dumps(view_json))
 
 def serve_tile(s):
-    s.wfile.write(json.dumps({ "type": "FeatureCollection" }))
+    if s.path.endswith("/5/16/15.geojson"):
+        s.wfile.write(json.dumps(fixture_tile))
+    else:
+        s.wfile.write(json.dumps({ "type": "FeatureCollection" }))
 
 class AsteroidMock(BaseHTTPServer.BaseHTTPRequestHandler):
     def do_HEAD(s):
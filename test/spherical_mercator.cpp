@@ -0,0 +1,102 @@
+// Checks the batch conversions in spherical_mercator.hpp against the
+// scalar ones, to the bounds documented there. Needs only boost headers:
+//
+//   make spherical_mercator && ./spherical_mercator
+
+#include "spherical_mercator.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+// Deterministic uniform doubles in [0, 1), so failures can be replayed.
+class lcg
+{
+    boost::uint64_t state_;
+public:
+    explicit lcg(boost::uint64_t seed) : state_(seed) {}
+    double operator()()
+    {
+        state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        return double(state_ >> 11) / 9007199254740992.0;
+    }
+};
+
+int failures = 0;
+
+void check(bool ok, const char * what, int zoom, double got, double want)
+{
+    if (ok) return;
+    if (++failures <= 10) {
+        std::fprintf(stderr, "FAIL: %s at zoom %d: batch %.17g, scalar %.17g\n",
+            what, zoom, got, want);
+    }
+}
+
+}
+
+int main()
+{
+    const std::size_t count = 20000;
+    mapnik::spherical_mercator<> merc;
+    lcg rand(42);
+    long pixel_total = 0;
+    long pixel_diffs = 0;
+
+    for (int z = 0; z <= mapnik::spherical_mercator<>::max_zoom; ++z) {
+        const double c = std::ldexp(256.0, z);
+
+        // from_pixels: latitudes within 1e-13 degrees, longitudes exact.
+        std::vector<double> xy(2 * count);
+        for (std::size_t i = 0; i < xy.size(); ++i) xy[i] = rand() * c;
+        std::vector<double> batch(xy);
+        merc.from_pixels(&batch[0], count, z);
+        for (std::size_t i = 0; i < count; ++i) {
+            double x = xy[2 * i];
+            double y = xy[2 * i + 1];
+            merc.from_pixels(x, y, z);
+            check(batch[2 * i] == x, "from_pixels longitude", z, batch[2 * i], x);
+            check(std::fabs(batch[2 * i + 1] - y) <= 1e-13,
+                "from_pixels latitude", z, batch[2 * i + 1], y);
+        }
+
+        // to_pixels: at most one pixel off, and only rarely.
+        std::vector<double> ll(2 * count);
+        for (std::size_t i = 0; i < count; ++i) {
+            ll[2 * i] = rand() * 360.0 - 180.0;
+            ll[2 * i + 1] = rand() * 170.0 - 85.0;
+        }
+        batch = ll;
+        merc.to_pixels(&batch[0], count, z);
+        for (std::size_t i = 0; i < count; ++i) {
+            double x = ll[2 * i];
+            double y = ll[2 * i + 1];
+            merc.to_pixels(x, y, z);
+            check(std::fabs(batch[2 * i] - x) <= 1, "to_pixels x", z, batch[2 * i], x);
+            check(std::fabs(batch[2 * i + 1] - y) <= 1, "to_pixels y", z,
+                batch[2 * i + 1], y);
+            ++pixel_total;
+            if (batch[2 * i] != x || batch[2 * i + 1] != y) ++pixel_diffs;
+        }
+    }
+
+    // A pixel only moves when a coordinate lands within rounding error
+    // of a half-pixel boundary.
+    if (pixel_diffs * 10000 > pixel_total) {
+        std::fprintf(stderr, "FAIL: to_pixels differs for %ld of %ld points\n",
+            pixel_diffs, pixel_total);
+        ++failures;
+    }
+
+    const int past_max = mapnik::spherical_mercator<>::max_zoom + 1;
+    double p[2] = { 0, 0 };
+    check(!merc.from_pixels(p, 1, -1), "zoom rejected", -1, 0, 0);
+    check(!merc.to_pixels(p, 1, past_max), "zoom rejected", past_max, 0, 0);
+
+    if (failures) return 1;
+    std::printf("spherical_mercator: ok (%ld of %ld to_pixels points moved)\n",
+        pixel_diffs, pixel_total);
+    return 0;
+}
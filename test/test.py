@@ -22,5 +22,36 @@ class JitDatasource(unittest.TestCase):
         eq_(str(t['geometry_type']), 'LineString')
         return ds
 
+    # Counts the roads of the mock's tile 5/16/15 that pass a filter. The
+    # query sits inside that tile at its zoom, so it's the only download.
+    def count_filtered(self, filter):
+        ds = mapnik.CreateDatasource({'type':'jit', 'url':'http://localhost:9000/view/osm.road.json',
+            'filter':filter})
+        size = 2 * 20037508.34 / 32
+        q = mapnik.Query(mapnik.Box2d(1000, 1000, size - 1000, size - 1000),
+            (256 / size, 256 / size))
+        return len(ds.features(q).features)
+
+    def test_filter_equal(self, *args, **kw):
+        eq_(self.count_filtered("[highway] = 'primary'"), 1)
+        eq_(self.count_filtered("[z_order] = 3"), 1)
+
+    def test_filter_range(self, *args, **kw):
+        eq_(self.count_filtered("[z_order] >= 3"), 2)
+        eq_(self.count_filtered("[z_order] > 0 and [z_order] < 5"), 2)
+
+    def test_filter_in(self, *args, **kw):
+        eq_(self.count_filtered("[highway] in ('primary', 'secondary')"), 2)
+
+    def test_filter_not_equal(self, *args, **kw):
+        # null and missing properties are unequal to everything
+        eq_(self.count_filtered("[highway] != 'primary'"), 4)
+        eq_(self.count_filtered("[highway] != 'primary' and [z_order] >= 1"), 2)
+
+    @raises(RuntimeError)
+    def test_invalid_filter(self, *args, **kw):
+        mapnik.CreateDatasource({'type':'jit', 'url':'http://localhost:9000/view/osm.road.json',
+            'filter':"[z_order] >= 'high'"})
+
 if __name__ == "__main__":
     [eval(run)() for run in dir() if 'test_' in run]
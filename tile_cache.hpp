@@ -0,0 +1,93 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MAPNIK_TILE_CACHE_HPP
+#define MAPNIK_TILE_CACHE_HPP
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+namespace mapnik {
+
+// Bounded, least-recently-used store of downloaded tile bodies keyed by
+// z/x/y. Safe to share between featuresets running on different threads.
+class tile_cache : private boost::noncopyable
+{
+public:
+    explicit tile_cache(std::size_t capacity)
+        : capacity_(capacity) {}
+
+    bool find(int z, int x, int y, std::string & body)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        index_type::iterator itr = index_.find(key_type(z, x, y));
+        if (itr == index_.end())
+        {
+            return false;
+        }
+        // move to the front of the recency list
+        items_.splice(items_.begin(), items_, itr->second);
+        body = itr->second->second;
+        return true;
+    }
+
+    void insert(int z, int x, int y, std::string const& body)
+    {
+        if (capacity_ == 0) return;
+        boost::mutex::scoped_lock lock(mutex_);
+        key_type key(z, x, y);
+        index_type::iterator itr = index_.find(key);
+        if (itr != index_.end())
+        {
+            itr->second->second = body;
+            items_.splice(items_.begin(), items_, itr->second);
+            return;
+        }
+        items_.push_front(std::make_pair(key, body));
+        index_[key] = items_.begin();
+        if (index_.size() > capacity_)
+        {
+            index_.erase(items_.back().first);
+            items_.pop_back();
+        }
+    }
+
+private:
+    typedef boost::tuple<int, int, int> key_type;
+    typedef std::list<std::pair<key_type, std::string> > list_type;
+    typedef std::map<key_type, list_type::iterator> index_type;
+
+    boost::mutex mutex_;
+    std::size_t capacity_;
+    list_type items_;
+    index_type index_;
+};
+
+}
+
+#endif // MAPNIK_TILE_CACHE_HPP
@@ -0,0 +1,219 @@
+/*****************************************************************************
+ *
+ * This file is part of Mapnik (c++ mapping toolkit)
+ *
+ * Copyright (C) 2011 Artem Pavlenko
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef MAPNIK_TILE_URL_HPP
+#define MAPNIK_TILE_URL_HPP
+
+#include <string>
+#include <vector>
+
+// urdl
+#include <urdl/url.hpp>
+
+namespace mapnik {
+
+// A tile url template such as http://host/{z}/{x}/{y}.geojson, split once
+// into literal segments and placeholder slots. The scheme, host and port
+// are parsed up front so that building a tile url only formats integers
+// into a caller-supplied buffer.
+//
+// Supported placeholders: {z}, {x}, {y}, {-y} (TMS row) and {quadkey}.
+// Anything else in braces is kept as literal text.
+class tile_url_template
+{
+public:
+    tile_url_template()
+        : segments_(),
+          base_(),
+          has_base_(false) {}
+
+    explicit tile_url_template(std::string const& tmpl)
+        : segments_(),
+          base_(),
+          has_base_(false)
+    {
+        // Pre-parse everything up to the path when it holds no
+        // placeholders; otherwise fall back to parsing every url.
+        std::string::size_type target = std::string::npos;
+        std::string::size_type scheme = tmpl.find("://");
+        if (scheme != std::string::npos)
+        {
+            target = tmpl.find('/', scheme + 3);
+        }
+        if (target != std::string::npos &&
+            tmpl.find('{') > target)
+        {
+            boost::system::error_code ec;
+            base_ = urdl::url::from_string(tmpl.substr(0, target), ec);
+            has_base_ = !ec;
+        }
+        compile(has_base_ ? tmpl.substr(target) : tmpl);
+    }
+
+    // Writes the url (or, with a pre-parsed base, just its path and query)
+    // for the tile into buf. buf is cleared, not shrunk, so it can be
+    // reused across tiles without reallocating.
+    void format(int z, int x, int y, std::string & buf) const
+    {
+        buf.clear();
+        std::vector<segment>::const_iterator itr = segments_.begin();
+        for (; itr != segments_.end(); ++itr)
+        {
+            switch (itr->type)
+            {
+            case slot_literal:
+                buf.append(itr->text);
+                break;
+            case slot_z:
+                append_int(buf, z);
+                break;
+            case slot_x:
+                append_int(buf, x);
+                break;
+            case slot_y:
+                append_int(buf, y);
+                break;
+            case slot_tms_y:
+                append_int(buf, (1 << z) - 1 - y);
+                break;
+            case slot_quadkey:
+                for (int i = z; i > 0; --i)
+                {
+                    int mask = 1 << (i - 1);
+                    char digit = '0';
+                    if (x & mask) digit += 1;
+                    if (y & mask) digit += 2;
+                    buf.push_back(digit);
+                }
+                break;
+            }
+        }
+    }
+
+    urdl::url make_url(int z, int x, int y, std::string & buf) const
+    {
+        format(z, x, y, buf);
+        if (!has_base_)
+        {
+            return urdl::url::from_string(buf);
+        }
+        urdl::url u(base_);
+        u.set_target(buf.data(), buf.size());
+        return u;
+    }
+
+    std::string to_string(int z, int x, int y) const
+    {
+        std::string buf;
+        format(z, x, y, buf);
+        if (!has_base_)
+        {
+            return buf;
+        }
+        return base_.to_string(urdl::url::protocol_component |
+                               urdl::url::user_info_component |
+                               urdl::url::host_component |
+                               urdl::url::port_component) + buf;
+    }
+
+private:
+    enum slot_t {
+        slot_literal,
+        slot_z,
+        slot_x,
+        slot_y,
+        slot_tms_y,
+        slot_quadkey
+    };
+
+    struct segment {
+        slot_t type;
+        std::string text;
+    };
+
+    void compile(std::string const& tmpl)
+    {
+        std::string literal;
+        std::string::size_type pos = 0;
+        while (pos < tmpl.size())
+        {
+            slot_t type = slot_literal;
+            std::string::size_type len = 0;
+            if (tmpl[pos] == '{')
+            {
+                if (tmpl.compare(pos, 3, "{z}") == 0) { type = slot_z; len = 3; }
+                else if (tmpl.compare(pos, 3, "{x}") == 0) { type = slot_x; len = 3; }
+                else if (tmpl.compare(pos, 3, "{y}") == 0) { type = slot_y; len = 3; }
+                else if (tmpl.compare(pos, 4, "{-y}") == 0) { type = slot_tms_y; len = 4; }
+                else if (tmpl.compare(pos, 9, "{quadkey}") == 0) { type = slot_quadkey; len = 9; }
+            }
+            if (type == slot_literal)
+            {
+                literal.push_back(tmpl[pos++]);
+                continue;
+            }
+            if (!literal.empty())
+            {
+                push(slot_literal, literal);
+                literal.clear();
+            }
+            push(type, std::string());
+            pos += len;
+        }
+        if (!literal.empty())
+        {
+            push(slot_literal, literal);
+        }
+    }
+
+    void push(slot_t type, std::string const& text)
+    {
+        segment s;
+        s.type = type;
+        s.text = text;
+        segments_.push_back(s);
+    }
+
+    static void append_int(std::string & buf, int value)
+    {
+        char tmp[16];
+        char* end = tmp + sizeof(tmp);
+        char* p = end;
+        unsigned v = value < 0 ? 0u - unsigned(value) : unsigned(value);
+        do
+        {
+            *--p = char('0' + v % 10);
+            v /= 10;
+        }
+        while (v);
+        if (value < 0) *--p = '-';
+        buf.append(p, end);
+    }
+
+    std::vector<segment> segments_;
+    urdl::url base_;
+    bool has_base_;
+};
+
+}
+
+#endif // MAPNIK_TILE_URL_HPP
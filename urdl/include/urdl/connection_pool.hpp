@@ -0,0 +1,175 @@
+//
+// connection_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef URDL_CONNECTION_POOL_HPP
+#define URDL_CONNECTION_POOL_HPP
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "urdl/detail/config.hpp"
+
+#include "urdl/detail/abi_prefix.hpp"
+
+namespace urdl {
+namespace http {
+
+/// A pool of idle persistent HTTP connections.
+/**
+ * When a @c connection_pool is supplied using the @c urdl::http::keep_alive
+ * option, requests are sent as HTTP/1.1 and a connection whose response body
+ * has been read in full is handed back to the pool when the stream is closed.
+ * The next request to the same protocol, host and port picks it up again
+ * instead of resolving, connecting and (for HTTPS) handshaking afresh.
+ *
+ * A pool may be shared by any number of streams and is safe to use from
+ * multiple threads. Connections are only reused by streams on the same
+ * @c io_service they were opened on. The pool must be destroyed before the
+ * @c io_service objects of the connections it holds.
+ *
+ * @par Example
+ * To reuse connections across a series of downloads:
+ * @code
+ * boost::shared_ptr<urdl::http::connection_pool> pool(
+ *     new urdl::http::connection_pool);
+ * urdl::read_stream stream(io_service);
+ * stream.set_option(urdl::http::keep_alive(pool));
+ * @endcode
+ *
+ * @par Requirements
+ * @e Header: @c <urdl/connection_pool.hpp> @n
+ * @e Namespace: @c urdl::http
+ */
+class connection_pool
+  : private boost::noncopyable
+{
+public:
+  /// Constructs an object of class @c connection_pool.
+  /**
+   * @param max_idle_per_host The maximum number of idle connections kept for
+   * each protocol, host and port. The least recently used connection is
+   * closed when the limit is exceeded.
+   *
+   * @param idle_timeout How long an idle connection is kept before it is
+   * closed rather than reused. This should be below the server's own
+   * keep-alive timeout.
+   */
+  explicit connection_pool(std::size_t max_idle_per_host = 8,
+      const boost::posix_time::time_duration& idle_timeout
+        = boost::posix_time::seconds(15))
+    : max_idle_per_host_(max_idle_per_host),
+      idle_timeout_(idle_timeout)
+  {
+  }
+
+  /// Gets the number of idle connections held by the pool.
+  std::size_t idle_count() const
+  {
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    return idle_.size();
+  }
+
+  /// Closes all idle connections.
+  void clear()
+  {
+    std::list<entry> expired;
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    expired.swap(idle_);
+  }
+
+  /// Removes an idle connection from the pool.
+  /**
+   * @returns The most recently released connection for @c owner and @c key,
+   * or an empty pointer if there is none. Used by the stream implementations.
+   */
+  boost::shared_ptr<void> take(const void* owner, const std::string& key)
+  {
+    std::list<entry> expired;
+    boost::shared_ptr<void> connection;
+    boost::posix_time::ptime now = now_utc();
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    std::list<entry>::iterator iter = idle_.begin();
+    while (iter != idle_.end())
+    {
+      if (iter->expires <= now)
+      {
+        expired.splice(expired.end(), idle_, iter++);
+      }
+      else if (!connection && iter->owner == owner && iter->key == key)
+      {
+        connection = iter->connection;
+        iter = idle_.erase(iter);
+      }
+      else
+      {
+        ++iter;
+      }
+    }
+    return connection;
+  }
+
+  /// Returns an idle connection to the pool.
+  /**
+   * The connection must have no outstanding operations and no unread data.
+   * Used by the stream implementations.
+   */
+  void put(const void* owner, const std::string& key,
+      const boost::shared_ptr<void>& connection)
+  {
+    std::list<entry> expired;
+    entry e;
+    e.owner = owner;
+    e.key = key;
+    e.connection = connection;
+    e.expires = now_utc() + idle_timeout_;
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    idle_.push_front(e);
+    std::size_t count = 0;
+    std::list<entry>::iterator iter = idle_.begin();
+    while (iter != idle_.end())
+    {
+      if (iter->owner == owner && iter->key == key
+          && ++count > max_idle_per_host_)
+        expired.splice(expired.end(), idle_, iter++);
+      else
+        ++iter;
+    }
+  }
+
+private:
+  struct entry
+  {
+    const void* owner;
+    std::string key;
+    boost::shared_ptr<void> connection;
+    boost::posix_time::ptime expires;
+  };
+
+  static boost::posix_time::ptime now_utc()
+  {
+    return boost::posix_time::microsec_clock::universal_time();
+  }
+
+  std::size_t max_idle_per_host_;
+  boost::posix_time::time_duration idle_timeout_;
+  mutable boost::asio::detail::mutex mutex_;
+  std::list<entry> idle_;
+};
+
+} // namespace http
+} // namespace urdl
+
+#include "urdl/detail/abi_suffix.hpp"
+
+#endif // URDL_CONNECTION_POOL_HPP
@@ -11,36 +11,355 @@
 #ifndef URDL_DETAIL_CONNECT_HPP
 #define URDL_DETAIL_CONNECT_HPP
 
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/detail/bind_handler.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/version.hpp>
+#include <cctype>
+#include <cstdlib>
 #include <sstream>
+#include <utility>
+#include <vector>
+#include "urdl/url.hpp"
 #include "urdl/detail/coroutine.hpp"
+#include "urdl/detail/resolver_cache.hpp"
 
 #include "urdl/detail/abi_prefix.hpp"
 
 namespace urdl {
 namespace detail {
 
+// Connects to one of a list of endpoints, starting a new attempt every
+// connect_race::delay while the earlier ones are still in progress, or
+// straight away when one fails. The first attempt to succeed wins and the
+// others are cancelled, so a dead address costs a short delay rather than a
+// full connect timeout.
+//
+// The first attempt uses the target socket. Later attempts use sockets of
+// their own; the winning one is moved into the target, which needs move
+// support in Asio. Without it, the attempts are made one at a time on the
+// target. With no target, every attempt has its own socket and the winner is
+// handed back through a pointer.
+template <typename Handler>
+class connect_race
+  : public boost::enable_shared_from_this<connect_race<Handler> >,
+    private boost::noncopyable
+{
+public:
+  typedef boost::asio::ip::tcp::socket::lowest_layer_type socket_type;
+  typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+  static boost::posix_time::time_duration delay()
+  {
+    return boost::posix_time::milliseconds(250);
+  }
+
+  connect_race(boost::asio::io_service& io_service, socket_type* target,
+      socket_ptr* winner, const resolver_cache::endpoints_ptr& endpoints,
+      Handler handler)
+    : io_service_(io_service),
+      target_(target),
+      winner_(winner),
+      endpoints_(endpoints),
+      handler_(handler),
+      sockets_(endpoints->size()),
+      timer_(io_service),
+#if defined(BOOST_ASIO_HAS_MOVE)
+      parallel_(true),
+#else // defined(BOOST_ASIO_HAS_MOVE)
+      parallel_(target == 0),
+#endif // defined(BOOST_ASIO_HAS_MOVE)
+      next_(0),
+      pending_(0),
+      done_(false),
+      last_ec_(boost::asio::error::host_not_found)
+  {
+  }
+
+  // Starts the first attempt. The handler is not called from within this
+  // function. There must be at least one endpoint.
+  void start()
+  {
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    start_next();
+  }
+
+private:
+  // Completion handlers for the attempts and the timer. They run the way the
+  // final handler would, e.g. in its strand, but use the default allocator
+  // as several of them are outstanding at once.
+  class attempt_handler
+  {
+  public:
+    attempt_handler(const boost::shared_ptr<connect_race>& race,
+        std::size_t index)
+      : race_(race),
+        index_(index)
+    {
+    }
+
+    void operator()(const boost::system::error_code& ec)
+    {
+      race_->handle_attempt(index_, ec);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        attempt_handler* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->final_handler());
+    }
+
+  private:
+    Handler& final_handler()
+    {
+      return race_->handler_;
+    }
+
+    boost::shared_ptr<connect_race> race_;
+    std::size_t index_;
+  };
+
+  class timer_handler
+  {
+  public:
+    explicit timer_handler(const boost::shared_ptr<connect_race>& race)
+      : race_(race)
+    {
+    }
+
+    void operator()(const boost::system::error_code& ec)
+    {
+      race_->handle_timer(ec);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        timer_handler* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->final_handler());
+    }
+
+  private:
+    Handler& final_handler()
+    {
+      return race_->handler_;
+    }
+
+    boost::shared_ptr<connect_race> race_;
+  };
+
+  // Starts an attempt on the next endpoint. Called with the lock held.
+  void start_next()
+  {
+    std::size_t index = next_++;
+    ++pending_;
+    const boost::asio::ip::tcp::endpoint& endpoint = (*endpoints_)[index];
+    if (target_ && (index == 0 || !parallel_))
+    {
+      boost::system::error_code ignored_ec;
+      target_->close(ignored_ec);
+      target_->async_connect(endpoint,
+          attempt_handler(this->shared_from_this(), index));
+    }
+    else
+    {
+      sockets_[index].reset(new boost::asio::ip::tcp::socket(io_service_));
+      sockets_[index]->async_connect(endpoint,
+          attempt_handler(this->shared_from_this(), index));
+    }
+
+    if (parallel_ && next_ < endpoints_->size())
+    {
+      timer_.expires_from_now(delay());
+      timer_.async_wait(timer_handler(this->shared_from_this()));
+    }
+  }
+
+  void handle_timer(const boost::system::error_code& ec)
+  {
+    if (ec)
+      return;
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    if (!done_ && next_ < endpoints_->size())
+      start_next();
+  }
+
+  void handle_attempt(std::size_t index, boost::system::error_code ec)
+  {
+    {
+      boost::asio::detail::mutex::scoped_lock lock(mutex_);
+      --pending_;
+      if (done_)
+        return;
+
+      if (ec == boost::asio::error::operation_aborted
+          || (target_ && !target_->is_open()))
+      {
+        // The caller closed the target socket to cancel the operation.
+        ec = boost::asio::error::operation_aborted;
+        finish(no_winner);
+      }
+      else if (!ec)
+      {
+        finish(index);
+      }
+      else
+      {
+        last_ec_ = ec;
+        if (next_ < endpoints_->size())
+          start_next();
+        if (pending_ > 0)
+          return;
+        finish(no_winner);
+      }
+    }
+    handler_(ec);
+  }
+
+  static const std::size_t no_winner = ~std::size_t(0);
+
+  // Ends the race, keeping the connection made by attempt winner if any.
+  // Called with the lock held.
+  void finish(std::size_t winner)
+  {
+    done_ = true;
+    boost::system::error_code ignored_ec;
+    timer_.cancel(ignored_ec);
+    for (std::size_t i = 0; i < sockets_.size(); ++i)
+      if (sockets_[i] && i != winner)
+        sockets_[i]->close(ignored_ec);
+
+    if (winner < sockets_.size() && sockets_[winner])
+    {
+      if (winner_)
+        *winner_ = sockets_[winner];
+#if defined(BOOST_ASIO_HAS_MOVE)
+      if (target_)
+        *target_ = std::move(*sockets_[winner]);
+#endif // defined(BOOST_ASIO_HAS_MOVE)
+    }
+    sockets_.clear();
+  }
+
+  boost::asio::io_service& io_service_;
+  socket_type* target_;
+  socket_ptr* winner_;
+  resolver_cache::endpoints_ptr endpoints_;
+  Handler handler_;
+  std::vector<socket_ptr> sockets_;
+  boost::asio::deadline_timer timer_;
+  bool parallel_;
+  std::size_t next_;
+  std::size_t pending_;
+  bool done_;
+  boost::system::error_code last_ec_;
+  boost::asio::detail::mutex mutex_;
+};
+
+// Runs a connect_race for the given endpoints and socket.
+template <typename Handler>
+void async_connect_endpoints(
+    boost::asio::ip::tcp::socket::lowest_layer_type& socket,
+    const resolver_cache::endpoints_ptr& endpoints, Handler handler)
+{
+  if (endpoints->empty())
+  {
+    boost::system::error_code ec = boost::asio::error::host_not_found;
+    socket.get_io_service().post(
+        boost::asio::detail::bind_handler(handler, ec));
+    return;
+  }
+  boost::shared_ptr<connect_race<Handler> > race(
+      new connect_race<Handler>(socket.get_io_service(),
+        &socket, 0, endpoints, handler));
+  race->start();
+}
+
+struct sync_connect_handler
+{
+  boost::system::error_code* ec_;
+
+  void operator()(const boost::system::error_code& ec)
+  {
+    *ec_ = ec;
+  }
+};
+
 inline boost::system::error_code connect(
     boost::asio::ip::tcp::socket::lowest_layer_type& socket,
     boost::asio::ip::tcp::resolver& resolver,
     const url& u, boost::system::error_code& ec)
 {
-  // Create a query that corresponds to the url.
   std::ostringstream port_string;
   port_string << u.port();
-  boost::asio::ip::tcp::resolver::query query(u.host(), port_string.str());
 
-  // Get a list of endpoints corresponding to the query.
-  boost::asio::ip::tcp::resolver::iterator iter = resolver.resolve(query, ec);
+  // Get a list of endpoints corresponding to the url. A stale cached answer is
+  // not used here, as there is no io_service running to refresh it.
+  resolver_cache& cache = resolver_cache::instance();
+  resolver_cache::endpoints_ptr endpoints;
+  bool refresh = false;
+  if (!cache.find(u.host(), port_string.str(), endpoints, ec, false, refresh))
+  {
+    boost::asio::ip::tcp::resolver::query query(u.host(), port_string.str());
+    endpoints = resolver_cache::make_endpoints(resolver.resolve(query, ec));
+    cache.store(u.host(), port_string.str(), endpoints, ec);
+  }
   if (ec)
     return ec;
 
-  // Try each endpoint until we successfully establish a connection.
-  ec = boost::asio::error::host_not_found;
-  while (ec && iter != boost::asio::ip::tcp::resolver::iterator())
+  if (endpoints->size() > 1)
   {
+    // Race the endpoints on a private io_service, then hand the winning
+    // connection over to the caller's socket.
+    boost::asio::io_service io_service;
+    connect_race<sync_connect_handler>::socket_ptr winner;
+    sync_connect_handler handler = { &ec };
+    boost::shared_ptr<connect_race<sync_connect_handler> > race(
+        new connect_race<sync_connect_handler>(
+          io_service, 0, &winner, endpoints, handler));
+    race->start();
+    race.reset();
+    io_service.run();
+    if (ec)
+      return ec;
+
+    boost::asio::ip::tcp::endpoint endpoint = winner->remote_endpoint(ec);
+    if (ec)
+      return ec;
     socket.close(ec);
-    socket.connect(*iter++, ec);
+#if BOOST_VERSION >= 106600
+    boost::asio::ip::tcp::socket::native_handle_type handle
+      = winner->release(ec);
+    if (!ec)
+      socket.assign(endpoint.protocol(), handle, ec);
+    else
+#endif // BOOST_VERSION >= 106600
+    {
+      // The connection cannot be moved to another io_service, but we know
+      // which address answers.
+      winner->close(ec);
+      socket.connect(endpoint, ec);
+    }
+  }
+  else
+  {
+    // Try each endpoint until we successfully establish a connection.
+    ec = boost::asio::error::host_not_found;
+    for (std::size_t i = 0; ec && i < endpoints->size(); ++i)
+    {
+      socket.close(ec);
+      socket.connect((*endpoints)[i], ec);
+    }
   }
   if (ec)
     return ec;
@@ -55,22 +374,26 @@ class connect_coro : coroutine
 public:
   connect_coro(Handler handler,
       boost::asio::ip::tcp::socket::lowest_layer_type& socket,
-      boost::asio::ip::tcp::resolver& resolver)
+      boost::asio::ip::tcp::resolver& resolver,
+      const std::string& host, const std::string& port)
     : handler_(handler),
       socket_(socket),
-      resolver_(resolver)
+      resolver_(resolver),
+      host_(host),
+      port_(port),
+      refresh_(false)
   {
   }
 
   void operator()(boost::system::error_code ec,
       boost::asio::ip::tcp::resolver::iterator iter)
   {
-    iter_ = iter;
+    endpoints_ = resolver_cache::make_endpoints(iter);
+    resolver_cache::instance().store(host_, port_, endpoints_, ec);
     (*this)(ec);
   }
 
-  void operator()(boost::system::error_code ec,
-      const boost::asio::ip::tcp::resolver::query* query = 0)
+  void operator()(boost::system::error_code ec)
   {
     URDL_CORO_BEGIN;
 
@@ -85,31 +408,38 @@ public:
       return;
     }
 
-    // Get a list of endpoints corresponding to the host name.
-    URDL_CORO_YIELD(resolver_.async_resolve(*query, *this));
-    if (ec)
+    // Get a list of endpoints corresponding to the host name. A cached
+    // answer is used straight away, even if it is stale, in which case it is
+    // refreshed in the background for the requests that follow.
+    if (resolver_cache::instance().find(host_, port_,
+          endpoints_, ec, true, refresh_))
     {
-      handler_(ec);
-      return;
+      if (refresh_)
+      {
+        resolver_cache::instance().async_refresh(
+            socket_.get_io_service(), host_, port_);
+      }
+      if (ec)
+      {
+        URDL_CORO_YIELD(socket_.get_io_service().post(
+              boost::asio::detail::bind_handler(*this, ec)));
+        handler_(ec);
+        return;
+      }
     }
-
-    // Try each endpoint until we successfully establish a connection.
-    ec = boost::asio::error::host_not_found;
-    while (ec && iter_ != boost::asio::ip::tcp::resolver::iterator())
+    else
     {
-      // Check whether the operation has been cancelled.
-      if (!socket_.is_open())
+      URDL_CORO_YIELD(resolver_.async_resolve(
+            boost::asio::ip::tcp::resolver::query(host_, port_), *this));
+      if (ec)
       {
-        ec = boost::asio::error::operation_aborted;
         handler_(ec);
         return;
       }
-
-      // Try next endpoint.
-      socket_.close(ec);
-      endpoint_ = *iter_++;
-      URDL_CORO_YIELD(socket_.async_connect(endpoint_, *this));
     }
+
+    // Race the endpoints until one of them accepts a connection.
+    URDL_CORO_YIELD(async_connect_endpoints(socket_, endpoints_, *this));
     if (ec)
     {
       handler_(ec);
@@ -158,8 +488,10 @@ private:
   Handler handler_;
   boost::asio::ip::tcp::socket::lowest_layer_type& socket_;
   boost::asio::ip::tcp::resolver& resolver_;
-  boost::asio::ip::tcp::resolver::iterator iter_;
-  boost::asio::ip::tcp::endpoint endpoint_;
+  std::string host_;
+  std::string port_;
+  resolver_cache::endpoints_ptr endpoints_;
+  bool refresh_;
 };
 
 template <typename Handler>
@@ -168,10 +500,85 @@ void async_connect(boost::asio::ip::tcp::socket::lowest_layer_type& socket,
 {
   std::ostringstream port_string;
   port_string << u.port();
-  boost::asio::ip::tcp::resolver::query query(u.host(), port_string.str());
-  connect_coro<Handler>(handler, socket, resolver)(
-      boost::system::error_code(), &query);
+  connect_coro<Handler>(handler, socket, resolver, u.host(),
+      port_string.str())(boost::system::error_code());
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Gets the endpoint named by an "http+unix" URL, whose host component is the
+// percent-encoded path of the socket, as in http+unix://%2Frun%2Fhttp.sock/.
+inline boost::system::error_code local_endpoint(const url& u,
+    boost::asio::local::stream_protocol::endpoint& endpoint,
+    boost::system::error_code& ec)
+{
+  std::string host = u.host();
+  std::string path;
+  for (std::size_t i = 0; i < host.size(); ++i)
+  {
+    if (host[i] == '%' && i + 2 < host.size() && std::isxdigit(host[i + 1])
+        && std::isxdigit(host[i + 2]))
+    {
+      path += static_cast<char>(
+          std::strtol(host.substr(i + 1, 2).c_str(), 0, 16));
+      i += 2;
+    }
+    else
+    {
+      path += host[i];
+    }
+  }
+
+  if (path.empty())
+  {
+    ec = make_error_code(boost::system::errc::invalid_argument);
+    return ec;
+  }
+
+  try
+  {
+    endpoint.path(path);
+  }
+  catch (boost::system::system_error& e)
+  {
+    // The path is too long for a socket address.
+    ec = e.code();
+    return ec;
+  }
+
+  ec = boost::system::error_code();
+  return ec;
+}
+
+inline boost::system::error_code connect(
+    boost::asio::local::stream_protocol::socket::lowest_layer_type& socket,
+    boost::asio::ip::tcp::resolver& /*resolver*/,
+    const url& u, boost::system::error_code& ec)
+{
+  boost::asio::local::stream_protocol::endpoint endpoint;
+  if (local_endpoint(u, endpoint, ec))
+    return ec;
+  socket.close(ec);
+  return socket.connect(endpoint, ec);
+}
+
+template <typename Handler>
+void async_connect(
+    boost::asio::local::stream_protocol::socket::lowest_layer_type& socket,
+    boost::asio::ip::tcp::resolver& /*resolver*/, const url& u,
+    Handler handler)
+{
+  boost::system::error_code ec;
+  boost::asio::local::stream_protocol::endpoint endpoint;
+  if (local_endpoint(u, endpoint, ec))
+  {
+    socket.get_io_service().post(
+        boost::asio::detail::bind_handler(handler, ec));
+    return;
+  }
+  socket.close(ec);
+  socket.async_connect(endpoint, handler);
 }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 
 } // namespace detail
 } // namespace urdl
@@ -15,6 +15,7 @@
 #include <cctype>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/address.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/asio/detail/bind_handler.hpp>
 #include "urdl/detail/coroutine.hpp"
 
@@ -44,6 +45,24 @@ void async_handshake(boost::asio::ip::tcp::socket& socket,
   socket.get_io_service().post(boost::asio::detail::bind_handler(handler, ec));
 }
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+inline boost::system::error_code handshake(
+    boost::asio::local::stream_protocol::socket& /*socket*/,
+    const std::string& /*host*/, boost::system::error_code& ec)
+{
+  ec = boost::system::error_code();
+  return ec;
+}
+
+template <typename Handler>
+void async_handshake(boost::asio::local::stream_protocol::socket& socket,
+    const std::string& /*host*/, Handler handler)
+{
+  boost::system::error_code ec;
+  socket.get_io_service().post(boost::asio::detail::bind_handler(handler, ec));
+}
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
 #if !defined(URDL_DISABLE_SSL)
 inline bool certificate_matches_host(X509* cert, const std::string& host)
 {
@@ -19,15 +19,23 @@
 #include <boost/asio/write.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/detail/bind_handler.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <algorithm>
 #include <ostream>
 #include <iterator>
+#include <vector>
+#include "urdl/connection_pool.hpp"
 #include "urdl/http.hpp"
 #include "urdl/option_set.hpp"
 #include "urdl/url.hpp"
 #include "urdl/detail/connect.hpp"
 #include "urdl/detail/coroutine.hpp"
 #include "urdl/detail/handshake.hpp"
+#include "urdl/detail/inflater.hpp"
 #include "urdl/detail/parsers.hpp"
 
 #include "urdl/detail/abi_prefix.hpp"
@@ -41,156 +49,102 @@ class http_read_stream
 public:
   explicit http_read_stream(boost::asio::io_service& io_service,
       option_set& options)
-    : resolver_(io_service),
-      socket_(io_service),
+    : io_service_(io_service),
+      resolver_(io_service),
+      make_socket_(boost::bind(&http_read_stream::make_socket,
+            boost::ref(io_service))),
+      socket_(make_socket_()),
       options_(options),
-      content_length_(0)
+      content_length_(0),
+      persistent_(false),
+      decompress_(false),
+      reused_(false),
+      head_started_(false),
+      pipelined_(0)
   {
+    reset_body();
   }
 
   template <typename Arg>
   http_read_stream(boost::asio::io_service& io_service,
       option_set& options, Arg& arg)
-    : resolver_(io_service),
-      socket_(io_service, arg),
+    : io_service_(io_service),
+      resolver_(io_service),
+      make_socket_(boost::bind(&http_read_stream::make_socket_with_arg<Arg>,
+            boost::ref(io_service), &arg)),
+      socket_(make_socket_()),
       options_(options),
-      content_length_(0)
+      content_length_(0),
+      persistent_(false),
+      decompress_(false),
+      reused_(false),
+      head_started_(false),
+      pipelined_(0)
   {
+    reset_body();
   }
 
   boost::system::error_code open(const url& u, boost::system::error_code& ec)
   {
     // Fail if the socket is already open.
-    if (socket_.lowest_layer().is_open())
+    if (socket_->lowest_layer().is_open())
     {
       ec = boost::asio::error::already_open;
       return ec;
     }
 
-    // Establish a connection to the HTTP server.
-    connect(socket_.lowest_layer(), resolver_, u, ec);
-    if (ec)
-      return ec;
-
-    // Perform SSL handshake if required.
-    handshake(socket_, u.host(), ec);
-    if (ec)
-      return ec;
-
-    // Get the HTTP options used to build the request.
-    std::string request_method
-      = options_.get_option<urdl::http::request_method>().value();
-    std::string request_content
-      = options_.get_option<urdl::http::request_content>().value();
-    std::string request_content_type
-      = options_.get_option<urdl::http::request_content_type>().value();
-    std::string user_agent
-      = options_.get_option<urdl::http::user_agent>().value();
-
-    // Form the request. We specify the "Connection: close" header so that the
-    // server will close the socket after transmitting the response. This will
-    // allow us to treat all data up until the EOF as the content.
-    std::ostream request_stream(&request_buffer_);
-    request_stream << request_method << " ";
-    request_stream << u.to_string(url::path_component | url::query_component);
-    request_stream << " HTTP/1.0\r\n";
-    request_stream << "Host: ";
-    request_stream << u.to_string(url::host_component | url::port_component);
-    request_stream << "\r\n";
-    request_stream << "Accept: */*\r\n";
-    if (request_content.length())
-    {
-      request_stream << "Content-Length: ";
-      request_stream << request_content.length() << "\r\n";
-      if (request_content_type.length())
-      {
-        request_stream << "Content-Type: ";
-        request_stream << request_content_type << "\r\n";
-      }
-    }
-    if (user_agent.length())
-      request_stream << "User-Agent: " << user_agent << "\r\n";
-    request_stream << "Connection: close\r\n\r\n";
-    request_stream << request_content;
+    start_open(u);
 
-    // Send the request.
-    boost::asio::write(socket_, request_buffer_,
-        boost::asio::transfer_all(), ec);
-    if (ec)
-      return ec;
-
-    int status_code = 0;
     for (;;)
     {
-      // Read the reply status line.
-      boost::asio::read_until(socket_, reply_buffer_, "\r\n", ec);
-      if (ec)
-        return ec;
+      // Nothing of this attempt's response has arrived yet.
+      head_started_ = false;
 
-      // Extract the response code from the status line.
-      int version_major = 0;
-      int version_minor = 0;
-      if (!parse_http_status_line(
-            std::istreambuf_iterator<char>(&reply_buffer_),
-            std::istreambuf_iterator<char>(),
-            version_major, version_minor, status_code))
+      // Establish a connection to the HTTP server, unless the pool has an
+      // idle one for us.
+      reused_ = take_pooled_connection();
+      if (!reused_)
       {
-        ec = http::errc::malformed_status_line;
-        return ec;
-      }
+        connect(socket_->lowest_layer(), resolver_, u, ec);
+        if (ec)
+          return ec;
 
-      // A "continue" header means we need to keep waiting.
-      if (status_code != http::errc::continue_request)
-        break;
-    }
+        // Perform SSL handshake if required.
+        handshake(*socket_, u.host(), ec);
+        if (ec)
+          return ec;
+      }
 
-    // Read list of headers and save them. If there's anything left in the reply
-    // buffer afterwards, it's the start of the content returned by the HTTP
-    // server.
-    std::size_t bytes_transferred = boost::asio::read_until(
-        socket_, reply_buffer_, "\r\n\r\n", ec);
-    headers_.resize(bytes_transferred);
-    reply_buffer_.sgetn(&headers_[0], bytes_transferred);
-    if (ec)
-      return ec;
+      // Send the request.
+      request_buffer_.consume(request_buffer_.size());
+      build_request(u);
+      boost::asio::write(*socket_, request_buffer_,
+          boost::asio::transfer_all(), ec);
+      if (!ec)
+        read_response(ec);
 
-    // Parse the headers to get Content-Type and Content-Length.
-    if (!parse_http_headers(headers_.begin(), headers_.end(),
-          content_type_, content_length_, location_))
-    {
-      ec = http::errc::malformed_response_headers;
+      // The server may have closed a pooled connection while it was idle.
+      if (ec && !head_started_ && can_retry())
+      {
+        discard_connection();
+        continue;
+      }
       return ec;
     }
-
-    // Check the response code to see if we got the page correctly.
-    if (status_code != http::errc::ok)
-      ec = make_error_code(static_cast<http::errc::errc_t>(status_code));
-
-    return ec;
   }
 
+  // Reads a response's status line and headers. The request has already
+  // been sent, possibly together with others ahead of it on the connection.
   template <typename Handler>
-  class open_coro : coroutine
+  class read_response_coro : coroutine
   {
   public:
-    open_coro(Handler handler, boost::asio::ip::tcp::resolver& resolver,
-        Stream& socket, const option_set& options,
-        boost::asio::streambuf& request_buffer,
-        boost::asio::streambuf& reply_buffer, const url& u,
-        std::string& headers, std::string& content_type,
-        std::size_t& content_length, std::string& location)
+    read_response_coro(Handler handler, http_read_stream* this_ptr)
       : handler_(handler),
-        resolver_(resolver),
-        socket_(socket),
-        options_(options),
-        request_buffer_(request_buffer),
-        reply_buffer_(reply_buffer),
-        url_(u),
-        headers_(headers),
-        status_code_(0),
-        content_type_(content_type),
-        content_length_(content_length),
-        location_(location)
+        this_(this_ptr),
+        version_major_(0),
+        version_minor_(0),
+        status_code_(0)
     {
     }
 
@@ -199,107 +153,26 @@ public:
     {
       URDL_CORO_BEGIN;
 
-      // Fail if the socket is already open.
-      if (socket_.lowest_layer().is_open())
-      {
-        ec = boost::asio::error::already_open;
-        URDL_CORO_YIELD(socket_.get_io_service().post(
-              boost::asio::detail::bind_handler(*this, ec)));
-        handler_(ec);
-        return;
-      }
-
-      // Establish a connection to the HTTP server.
-      URDL_CORO_YIELD(async_connect(socket_.lowest_layer(),
-            resolver_, url_, *this));
-      if (ec)
-      {
-        handler_(ec);
-        return;
-      }
-
-      // Perform SSL handshake if required.
-      URDL_CORO_YIELD(async_handshake(socket_, url_.host(), *this));
-      if (ec)
-      {
-        handler_(ec);
-        return;
-      }
-
-      {
-        // Get the HTTP options used to build the request.
-        std::string request_method
-          = options_.get_option<urdl::http::request_method>().value();
-        std::string request_content
-          = options_.get_option<urdl::http::request_content>().value();
-        std::string request_content_type
-          = options_.get_option<urdl::http::request_content_type>().value();
-        std::string user_agent
-          = options_.get_option<urdl::http::user_agent>().value();
-
-        // Form the request. We specify the "Connection: close" header so that
-        // the server will close the socket after transmitting the response.
-        // This will allow us to treat all data up until the EOF as the
-        // content.
-        std::ostream request_stream(&request_buffer_);
-        request_stream << request_method << " ";
-        request_stream << url_.to_string(
-            url::path_component | url::query_component);
-        request_stream << " HTTP/1.0\r\n";
-        request_stream << "Host: ";
-        request_stream << url_.to_string(
-            url::host_component | url::port_component);
-        request_stream << "\r\n";
-        request_stream << "Accept: */*\r\n";
-        if (request_content.length())
-        {
-          request_stream << "Content-Length: ";
-          request_stream << request_content.length() << "\r\n";
-          if (request_content_type.length())
-          {
-            request_stream << "Content-Type: ";
-            request_stream << request_content_type << "\r\n";
-          }
-        }
-        if (user_agent.length())
-          request_stream << "User-Agent: " << user_agent << "\r\n";
-        request_stream << "Connection: close\r\n\r\n";
-        request_stream << request_content;
-      }
-
-      // Send the request.
-      URDL_CORO_YIELD(boost::asio::async_write(socket_,
-            request_buffer_, boost::asio::transfer_all(), *this));
-      if (ec)
-      {
-        handler_(ec);
-        return;
-      }
-
+      this_->head_started_ = false;
       for (;;)
       {
         // Read the reply status line.
-        URDL_CORO_YIELD(boost::asio::async_read_until(socket_,
-              reply_buffer_, "\r\n", *this));
+        URDL_CORO_YIELD(boost::asio::async_read_until(*this_->socket_,
+              this_->reply_buffer_, "\r\n", *this));
         if (ec)
         {
           handler_(ec);
           return;
         }
+        this_->head_started_ = true;
 
         // Check the response code to see if we got the page correctly.
+        if (!this_->parse_status_line(bytes_transferred,
+              version_major_, version_minor_, status_code_))
         {
-          int version_major = 0;
-          int version_minor = 0;
-          if (!parse_http_status_line(
-                std::istreambuf_iterator<char>(&reply_buffer_),
-                std::istreambuf_iterator<char>(),
-                version_major, version_minor, status_code_))
-          {
-            ec = http::errc::malformed_status_line;
-            handler_(ec);
-            return;
-          }
+          ec = http::errc::malformed_status_line;
+          handler_(ec);
+          return;
         }
 
         // A "continue" header means we need to keep waiting.
@@ -310,10 +183,8 @@ public:
       // Read list of headers and save them. If there's anything left in the
       // reply buffer afterwards, it's the start of the content returned by the
       // HTTP server.
-      URDL_CORO_YIELD(boost::asio::async_read_until(socket_,
-            reply_buffer_, "\r\n\r\n", *this));
-      headers_.resize(bytes_transferred);
-      reply_buffer_.sgetn(&headers_[0], bytes_transferred);
+      URDL_CORO_YIELD(boost::asio::async_read_until(*this_->socket_,
+            this_->reply_buffer_, "\r\n\r\n", *this));
       if (ec)
       {
         handler_(ec);
@@ -321,8 +192,8 @@ public:
       }
 
       // Parse the headers to get Content-Type and Content-Length.
-      if (!parse_http_headers(headers_.begin(), headers_.end(),
-            content_type_, content_length_, location_))
+      if (!this_->parse_headers(bytes_transferred,
+            version_major_, version_minor_, status_code_))
       {
         ec = http::errc::malformed_response_headers;
         handler_(ec);
@@ -338,6 +209,126 @@ public:
       URDL_CORO_END;
     }
 
+    friend void* asio_handler_allocate(std::size_t size,
+        read_response_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_allocate;
+      return asio_handler_allocate(size, &this_handler->handler_);
+    }
+
+    friend void asio_handler_deallocate(void* pointer, std::size_t size,
+        read_response_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_deallocate;
+      asio_handler_deallocate(pointer, size, &this_handler->handler_);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        read_response_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->handler_);
+    }
+
+  private:
+    Handler handler_;
+    http_read_stream* this_;
+    int version_major_;
+    int version_minor_;
+    int status_code_;
+  };
+
+  template <typename Handler>
+  class open_coro : coroutine
+  {
+  public:
+    open_coro(Handler handler, http_read_stream* this_ptr, const url& u,
+        const std::vector<url>* pipelined)
+      : handler_(handler),
+        this_(this_ptr),
+        url_(u),
+        pipelined_(pipelined)
+    {
+    }
+
+    void operator()(boost::system::error_code ec,
+        std::size_t /*bytes_transferred*/ = 0)
+    {
+      URDL_CORO_BEGIN;
+
+      // Fail if the socket is already open.
+      if (this_->socket_->lowest_layer().is_open())
+      {
+        ec = boost::asio::error::already_open;
+        URDL_CORO_YIELD(this_->io_service_.post(
+              boost::asio::detail::bind_handler(*this, ec)));
+        handler_(ec);
+        return;
+      }
+
+      this_->start_open(url_, pipelined_ != 0);
+
+      for (;;)
+      {
+        // Nothing of this attempt's response has arrived yet.
+        this_->head_started_ = false;
+
+        // Establish a connection to the HTTP server, unless the pool has an
+        // idle one for us.
+        this_->reused_ = this_->take_pooled_connection();
+        if (!this_->reused_)
+        {
+          URDL_CORO_YIELD(async_connect(this_->socket_->lowest_layer(),
+                this_->resolver_, url_, *this));
+          if (ec)
+          {
+            handler_(ec);
+            return;
+          }
+
+          // Perform SSL handshake if required.
+          URDL_CORO_YIELD(async_handshake(*this_->socket_, url_.host(), *this));
+          if (ec)
+          {
+            handler_(ec);
+            return;
+          }
+        }
+
+        // Send the request, or all of the pipelined requests in one go.
+        this_->request_buffer_.consume(this_->request_buffer_.size());
+        if (pipelined_)
+        {
+          for (std::size_t i = 0; i < pipelined_->size(); ++i)
+            this_->build_request((*pipelined_)[i]);
+          this_->pipelined_ = pipelined_->size() - 1;
+        }
+        else
+        {
+          this_->build_request(url_);
+        }
+        URDL_CORO_YIELD(boost::asio::async_write(*this_->socket_,
+              this_->request_buffer_, boost::asio::transfer_all(), *this));
+        if (!ec)
+        {
+          URDL_CORO_YIELD(read_response_coro<open_coro>(
+                *this, this_)(boost::system::error_code()));
+        }
+
+        // The server may have closed a pooled connection while it was idle.
+        if (ec && !this_->head_started_ && this_->can_retry())
+        {
+          this_->discard_connection();
+          continue;
+        }
+        handler_(ec);
+        return;
+      }
+
+      URDL_CORO_END;
+    }
+
     friend void* asio_handler_allocate(std::size_t size,
         open_coro<Handler>* this_handler)
     {
@@ -362,45 +353,94 @@ public:
 
   private:
     Handler handler_;
-    boost::asio::ip::tcp::resolver& resolver_;
-    Stream& socket_;
-    const option_set& options_;
-    boost::asio::streambuf& request_buffer_;
-    boost::asio::streambuf& reply_buffer_;
+    http_read_stream* this_;
     url url_;
-    std::string& headers_;
-    int status_code_;
-    std::string& content_type_;
-    std::size_t& content_length_;
-    std::string& location_;
+    const std::vector<url>* pipelined_;
   };
 
   template <typename Handler>
   void async_open(const url& u, Handler handler)
   {
-    open_coro<Handler>(handler, resolver_, socket_, options_, request_buffer_,
-        reply_buffer_, u, headers_, content_type_, content_length_, location_)(
-          boost::system::error_code(), 0);
+    open_coro<Handler>(handler, this, u, 0)(boost::system::error_code(), 0);
+  }
+
+  // Sends GET requests for all of urls back to back on one persistent
+  // connection, then reads the first response. The following responses are
+  // read with async_next_response(). All urls must have the same protocol,
+  // host and port, and must outlive the operation.
+  template <typename Handler>
+  void async_open_pipelined(const std::vector<url>& urls, Handler handler)
+  {
+    open_coro<Handler>(handler, this, urls.front(), &urls)(
+        boost::system::error_code(), 0);
+  }
+
+  // Whether another pipelined response can be read once the current body
+  // has been read to the end.
+  bool has_next_response() const
+  {
+    return pipelined_ > 0 && reusable_;
+  }
+
+  template <typename Handler>
+  void async_next_response(Handler handler)
+  {
+    if (!has_next_response() || !body_done_)
+    {
+      boost::system::error_code ec = boost::asio::error::connection_aborted;
+      io_service_.post(boost::asio::detail::bind_handler(handler, ec));
+      return;
+    }
+    --pipelined_;
+    headers_.clear();
+    etag_.clear();
+    cache_control_.clear();
+    content_type_.clear();
+    content_length_ = 0;
+    location_.clear();
+    reused_ = false;
+    reset_body();
+    read_response_coro<Handler>(handler, this)(boost::system::error_code());
   }
 
   boost::system::error_code close(boost::system::error_code& ec)
   {
     resolver_.cancel();
-    if (!socket_.lowest_layer().close(ec))
+    if (can_pool())
+    {
+      // The whole response has been read, so the connection can carry the
+      // next request.
+      pool_->put(&io_service_, pool_key_, socket_);
+      socket_ = make_socket_();
+      ec = boost::system::error_code();
+    }
+    else
+    {
+      socket_->lowest_layer().close(ec);
+    }
+    if (!ec)
     {
       request_buffer_.consume(request_buffer_.size());
       reply_buffer_.consume(reply_buffer_.size());
       headers_.clear();
+      etag_.clear();
+      cache_control_.clear();
       content_type_.clear();
       content_length_ = 0;
       location_.clear();
+      pool_.reset();
+      pool_key_.clear();
+      persistent_ = false;
+      reused_ = false;
+      pipelined_ = 0;
+      reset_body();
     }
     return ec;
   }
 
   bool is_open() const
   {
-    return socket_.lowest_layer().is_open();
+    return socket_->lowest_layer().is_open();
   }
 
   std::string content_type() const
@@ -423,34 +463,60 @@ public:
     return headers_;
   }
 
+  std::string etag() const
+  {
+    return etag_;
+  }
+
+  std::string cache_control() const
+  {
+    return cache_control_;
+  }
+
   template <typename MutableBufferSequence>
   std::size_t read_some(const MutableBufferSequence& buffers,
       boost::system::error_code& ec)
   {
-    // If we have any data in the reply_buffer_, return that first.
-    if (reply_buffer_.size() > 0)
+#if !defined(URDL_DISABLE_ZLIB)
+    if (inflater_)
+      return read_inflated(first_buffer(buffers), ec);
+#endif // !defined(URDL_DISABLE_ZLIB)
+    return read_body_some(buffers, ec);
+  }
+
+  // Reads the body as it was sent, before any content coding is undone.
+  template <typename MutableBufferSequence>
+  std::size_t read_body_some(const MutableBufferSequence& buffers,
+      boost::system::error_code& ec)
+  {
+    if (body_mode_ == body_until_eof)
+      return read_raw(buffers, ec);
+
+    // Persistent connection: stop at the end of the body rather than at EOF.
+    while (body_mode_ == body_chunked && !body_done_ && body_remaining_ == 0)
     {
-      std::size_t bytes_transferred = 0;
-      typename MutableBufferSequence::const_iterator iter = buffers.begin();
-      typename MutableBufferSequence::const_iterator end = buffers.end();
-      for (; iter != end && reply_buffer_.size() > 0; ++iter)
+      std::size_t length = boost::asio::read_until(
+          *socket_, reply_buffer_, "\r\n", ec);
+      if (ec)
       {
-        boost::asio::mutable_buffer buffer(*iter);
-        size_t length = boost::asio::buffer_size(buffer);
-        if (length > 0)
-        {
-          bytes_transferred += reply_buffer_.sgetn(
-              boost::asio::buffer_cast<char*>(buffer), length);
-        }
+        end_body(ec);
+        return 0;
+      }
+      if (!parse_chunk_line(length))
+      {
+        ec = http::errc::malformed_response_headers;
+        end_body(ec);
+        return 0;
       }
-      ec = boost::system::error_code();
-      return bytes_transferred;
     }
-
-    // Otherwise we forward the call to the underlying socket.
-    std::size_t bytes_transferred = socket_.read_some(buffers, ec);
-    if (ec == boost::asio::error::shut_down)
+    if (body_done_)
+    {
       ec = boost::asio::error::eof;
+      return 0;
+    }
+    std::size_t bytes_transferred = read_raw(
+        body_buffer(first_buffer(buffers)), ec);
+    consume_body(bytes_transferred, ec);
     return bytes_transferred;
   }
 
@@ -496,33 +562,675 @@ public:
     Handler handler_;
   };
 
-  template <typename MutableBufferSequence, typename Handler>
-  void async_read_some(const MutableBufferSequence& buffers, Handler handler)
+  // Reads the next piece of a Content-Length or chunked body, fetching chunk
+  // headers from the socket as needed.
+  template <typename Handler>
+  class body_read_coro : coroutine
   {
-    // If we have any data in the reply_buffer_, return that first.
-    if (reply_buffer_.size() > 0)
+  public:
+    body_read_coro(Handler handler, http_read_stream* this_ptr,
+        const boost::asio::mutable_buffer& buffer)
+      : handler_(handler),
+        this_(this_ptr),
+        buffer_(buffer)
     {
-      boost::system::error_code ec;
-      std::size_t bytes_transferred = read_some(buffers, ec);
-      socket_.get_io_service().post(boost::asio::detail::bind_handler(
-            handler, ec, bytes_transferred));
-      return;
     }
 
-    // Otherwise we forward the call to the underlying socket.
-    socket_.async_read_some(buffers, read_handler<Handler>(handler));
+    void operator()(boost::system::error_code ec,
+        std::size_t bytes_transferred = 0)
+    {
+      URDL_CORO_BEGIN;
+
+      while (this_->body_mode_ == body_chunked && !this_->body_done_
+          && this_->body_remaining_ == 0)
+      {
+        URDL_CORO_YIELD(boost::asio::async_read_until(*this_->socket_,
+              this_->reply_buffer_, "\r\n", *this));
+        if (ec)
+        {
+          this_->end_body(ec);
+          handler_(ec, 0);
+          return;
+        }
+        if (!this_->parse_chunk_line(bytes_transferred))
+        {
+          ec = http::errc::malformed_response_headers;
+          this_->end_body(ec);
+          handler_(ec, 0);
+          return;
+        }
+      }
+
+      if (this_->body_done_)
+      {
+        ec = boost::asio::error::eof;
+        URDL_CORO_YIELD(this_->io_service_.post(
+              boost::asio::detail::bind_handler(*this, ec, 0)));
+        handler_(ec, 0);
+        return;
+      }
+
+      if (this_->reply_buffer_.size() > 0)
+      {
+        bytes_transferred = this_->read_raw(
+            this_->body_buffer(buffer_), ec);
+        URDL_CORO_YIELD(this_->io_service_.post(
+              boost::asio::detail::bind_handler(*this, ec, bytes_transferred)));
+      }
+      else
+      {
+        URDL_CORO_YIELD(this_->socket_->async_read_some(
+              this_->body_buffer(buffer_), *this));
+      }
+      this_->consume_body(bytes_transferred, ec);
+      handler_(ec, bytes_transferred);
+
+      URDL_CORO_END;
+    }
+
+    friend void* asio_handler_allocate(std::size_t size,
+        body_read_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_allocate;
+      return asio_handler_allocate(size, &this_handler->handler_);
+    }
+
+    friend void asio_handler_deallocate(void* pointer, std::size_t size,
+        body_read_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_deallocate;
+      asio_handler_deallocate(pointer, size, &this_handler->handler_);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        body_read_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->handler_);
+    }
+
+  private:
+    Handler handler_;
+    http_read_stream* this_;
+    boost::asio::mutable_buffer buffer_;
+  };
+
+#if !defined(URDL_DISABLE_ZLIB)
+  // Inflates a compressed body into the caller's buffer, reading more of the
+  // body whenever the inflater runs out of input.
+  template <typename Handler>
+  class inflate_coro : coroutine
+  {
+  public:
+    inflate_coro(Handler handler, http_read_stream* this_ptr,
+        const boost::asio::mutable_buffer& buffer)
+      : handler_(handler),
+        this_(this_ptr),
+        buffer_(buffer)
+    {
+    }
+
+    void operator()(boost::system::error_code ec,
+        std::size_t bytes_transferred = 0)
+    {
+      URDL_CORO_BEGIN;
+
+      for (;;)
+      {
+        if (this_->inflater_->finished())
+        {
+          // Read past anything after the compressed data, so that a
+          // persistent connection is left at the end of the body.
+          do
+          {
+            URDL_CORO_YIELD(this_->async_read_body_some(
+                  this_->inflater_->input_buffer(), *this));
+          } while (!ec);
+          handler_(ec, 0);
+          return;
+        }
+
+        if (!this_->inflater_->needs_input())
+        {
+          bytes_transferred = this_->inflater_->inflate(buffer_, ec);
+          if (ec)
+            this_->reusable_ = false;
+          if (ec || bytes_transferred > 0
+              || boost::asio::buffer_size(buffer_) == 0)
+          {
+            URDL_CORO_YIELD(this_->io_service_.post(
+                  boost::asio::detail::bind_handler(
+                    *this, ec, bytes_transferred)));
+            handler_(ec, bytes_transferred);
+            return;
+          }
+          continue;
+        }
+
+        URDL_CORO_YIELD(this_->async_read_body_some(
+              this_->inflater_->input_buffer(), *this));
+        if (ec == boost::asio::error::eof)
+          ec = boost::asio::error::connection_reset; // Truncated stream.
+        if (ec)
+        {
+          handler_(ec, 0);
+          return;
+        }
+        this_->inflater_->commit_input(bytes_transferred);
+      }
+
+      URDL_CORO_END;
+    }
+
+    friend void* asio_handler_allocate(std::size_t size,
+        inflate_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_allocate;
+      return asio_handler_allocate(size, &this_handler->handler_);
+    }
+
+    friend void asio_handler_deallocate(void* pointer, std::size_t size,
+        inflate_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_deallocate;
+      asio_handler_deallocate(pointer, size, &this_handler->handler_);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        inflate_coro<Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->handler_);
+    }
+
+  private:
+    Handler handler_;
+    http_read_stream* this_;
+    boost::asio::mutable_buffer buffer_;
+  };
+#endif // !defined(URDL_DISABLE_ZLIB)
+
+  template <typename MutableBufferSequence, typename Handler>
+  void async_read_some(const MutableBufferSequence& buffers, Handler handler)
+  {
+#if !defined(URDL_DISABLE_ZLIB)
+    if (inflater_)
+    {
+      inflate_coro<Handler>(handler, this, first_buffer(buffers))(
+          boost::system::error_code(), 0);
+      return;
+    }
+#endif // !defined(URDL_DISABLE_ZLIB)
+    async_read_body_some(buffers, handler);
+  }
+
+  template <typename MutableBufferSequence, typename Handler>
+  void async_read_body_some(const MutableBufferSequence& buffers,
+      Handler handler)
+  {
+    if (body_mode_ != body_until_eof)
+    {
+      body_read_coro<Handler>(handler, this, first_buffer(buffers))(
+          boost::system::error_code(), 0);
+      return;
+    }
+
+    // If we have any data in the reply_buffer_, return that first.
+    if (reply_buffer_.size() > 0)
+    {
+      boost::system::error_code ec;
+      std::size_t bytes_transferred = read_raw(buffers, ec);
+      io_service_.post(boost::asio::detail::bind_handler(
+            handler, ec, bytes_transferred));
+      return;
+    }
+
+    // Otherwise we forward the call to the underlying socket.
+    socket_->async_read_some(buffers, read_handler<Handler>(handler));
   }
 
 private:
+  // How the end of the response body is found.
+  enum body_mode_t
+  {
+    body_until_eof,  // HTTP/1.0 style: the server closes the connection
+    body_length,     // Content-Length bytes follow the headers
+    body_chunked     // chunked transfer coding
+  };
+
+  boost::system::error_code read_response(boost::system::error_code& ec)
+  {
+    int version_major = 0;
+    int version_minor = 0;
+    int status_code = 0;
+    head_started_ = false;
+    for (;;)
+    {
+      // Read the reply status line.
+      std::size_t length = boost::asio::read_until(
+          *socket_, reply_buffer_, "\r\n", ec);
+      if (ec)
+        return ec;
+      head_started_ = true;
+
+      // Extract the response code from the status line.
+      if (!parse_status_line(length, version_major, version_minor, status_code))
+      {
+        ec = http::errc::malformed_status_line;
+        return ec;
+      }
+
+      // A "continue" header means we need to keep waiting.
+      if (status_code != http::errc::continue_request)
+        break;
+    }
+
+    // Read list of headers and save them. If there's anything left in the reply
+    // buffer afterwards, it's the start of the content returned by the HTTP
+    // server.
+    std::size_t bytes_transferred = boost::asio::read_until(
+        *socket_, reply_buffer_, "\r\n\r\n", ec);
+    if (ec)
+      return ec;
+
+    // Parse the headers to get Content-Type and Content-Length.
+    if (!parse_headers(bytes_transferred,
+          version_major, version_minor, status_code))
+    {
+      ec = http::errc::malformed_response_headers;
+      return ec;
+    }
+
+    // Check the response code to see if we got the page correctly.
+    if (status_code != http::errc::ok)
+      ec = make_error_code(static_cast<http::errc::errc_t>(status_code));
+
+    return ec;
+  }
+
+  static boost::shared_ptr<Stream> make_socket(
+      boost::asio::io_service& io_service)
+  {
+    return boost::shared_ptr<Stream>(new Stream(io_service));
+  }
+
+  template <typename Arg>
+  static boost::shared_ptr<Stream> make_socket_with_arg(
+      boost::asio::io_service& io_service, Arg* arg)
+  {
+    return boost::shared_ptr<Stream>(new Stream(io_service, *arg));
+  }
+
+  void start_open(const url& u, bool pipelined = false)
+  {
+    pool_ = options_.get_option<urdl::http::keep_alive>().value();
+    persistent_ = pool_ || pipelined;
+    pool_key_.clear();
+    if (pool_)
+    {
+      pool_key_ = u.protocol() + "://" + u.host() + ":"
+        + boost::lexical_cast<std::string>(u.port());
+    }
+    request_method_ = options_.get_option<urdl::http::request_method>().value();
+#if !defined(URDL_DISABLE_ZLIB)
+    decompress_ = options_.get_option<urdl::http::decompress>().value();
+#endif // !defined(URDL_DISABLE_ZLIB)
+    pipelined_ = 0;
+    head_started_ = false;
+    reset_body();
+  }
+
+  bool take_pooled_connection()
+  {
+    if (!pool_)
+      return false;
+    boost::shared_ptr<void> connection = pool_->take(&io_service_, pool_key_);
+    if (!connection)
+      return false;
+    socket_ = boost::static_pointer_cast<Stream>(connection);
+    return true;
+  }
+
+  // A request that failed on a pooled connection before any response arrived
+  // is sent again on a fresh one, as long as repeating it is harmless.
+  bool can_retry() const
+  {
+    return reused_ && (request_method_ == "GET" || request_method_ == "HEAD");
+  }
+
+  void discard_connection()
+  {
+    boost::system::error_code ignored_ec;
+    socket_->lowest_layer().close(ignored_ec);
+    socket_ = make_socket_();
+    request_buffer_.consume(request_buffer_.size());
+    reply_buffer_.consume(reply_buffer_.size());
+  }
+
+  void build_request(const url& u)
+  {
+    // Get the HTTP options used to build the request.
+    std::string request_content
+      = options_.get_option<urdl::http::request_content>().value();
+    std::string request_content_type
+      = options_.get_option<urdl::http::request_content_type>().value();
+    std::string user_agent
+      = options_.get_option<urdl::http::user_agent>().value();
+
+    // Form the request. Unless the connection is to be kept open we specify
+    // the "Connection: close" header so that the server will close the socket
+    // after transmitting the response. This will allow us to treat all data up
+    // until the EOF as the content.
+    std::ostream request_stream(&request_buffer_);
+    request_stream << request_method_ << " ";
+    request_stream << u.to_string(url::path_component | url::query_component);
+    request_stream << (persistent_ ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+    request_stream << "Host: ";
+    if (u.protocol() == "http+unix")
+      request_stream << "localhost"; // The host names the socket's path.
+    else
+      request_stream << u.to_string(url::host_component | url::port_component);
+    request_stream << "\r\n";
+    request_stream << "Accept: */*\r\n";
+    if (request_content.length())
+    {
+      request_stream << "Content-Length: ";
+      request_stream << request_content.length() << "\r\n";
+      if (request_content_type.length())
+      {
+        request_stream << "Content-Type: ";
+        request_stream << request_content_type << "\r\n";
+      }
+    }
+    if (user_agent.length())
+      request_stream << "User-Agent: " << user_agent << "\r\n";
+    if (decompress_)
+      request_stream << "Accept-Encoding: gzip, deflate\r\n";
+    if (persistent_)
+      request_stream << "Connection: keep-alive\r\n\r\n";
+    else
+      request_stream << "Connection: close\r\n\r\n";
+    request_stream << request_content;
+  }
+
+  // Parses the status line of length bytes at the start of reply_buffer_ in
+  // place, then consumes it.
+  bool parse_status_line(std::size_t length,
+      int& version_major, int& version_minor, int& status_code)
+  {
+    const char* begin = boost::asio::buffer_cast<const char*>(
+        reply_buffer_.data());
+    bool ok = parse_http_status_line(begin, begin + length,
+        version_major, version_minor, status_code);
+    reply_buffer_.consume(length);
+    return ok;
+  }
+
+  // Parses the header block of length bytes at the start of reply_buffer_ in
+  // place, then consumes it, and works out where the body ends and whether
+  // the connection can be reused afterwards. The block is also kept in
+  // headers_, as headers() must still return it once the body has been read.
+  bool parse_headers(std::size_t length,
+      int version_major, int version_minor, int status_code)
+  {
+    const char* begin = boost::asio::buffer_cast<const char*>(
+        reply_buffer_.data());
+    headers_.assign(begin, length);
+    http_head_fields fields;
+    bool ok = parse_http_headers(begin, begin + length, fields)
+      && parse_header_fields(fields,
+          version_major, version_minor, status_code);
+    reply_buffer_.consume(length);
+    return ok;
+  }
+
+  // Takes what is needed from the parsed fields, which point into
+  // reply_buffer_.
+  bool parse_header_fields(const http_head_fields& fields,
+      int version_major, int version_minor, int status_code)
+  {
+    content_length_ = 0;
+    bool has_content_length = !fields.content_length.empty();
+    if (has_content_length
+        && !parse_content_length(fields.content_length, content_length_))
+      return false;
+    content_type_ = fields.content_type.str();
+    location_ = fields.location.str();
+    etag_ = fields.etag.str();
+    cache_control_ = fields.cache_control.str();
+    const string_ref& transfer_encoding = fields.transfer_encoding;
+    const string_ref& connection = fields.connection;
+    const string_ref& content_encoding = fields.content_encoding;
+
+    reset_body();
+#if !defined(URDL_DISABLE_ZLIB)
+    if (decompress_)
+    {
+      if (header_has_token(content_encoding, "gzip")
+          || header_has_token(content_encoding, "x-gzip"))
+        inflater_.reset(new inflater(false));
+      else if (header_has_token(content_encoding, "deflate"))
+        inflater_.reset(new inflater(true));
+    }
+#endif // !defined(URDL_DISABLE_ZLIB)
+    if (!persistent_)
+      return true;
+
+    bool http_1_1 = version_major > 1
+      || (version_major == 1 && version_minor >= 1);
+    reusable_ = !header_has_token(connection, "close")
+      && (http_1_1 || header_has_token(connection, "keep-alive"));
+
+    if (request_method_ == "HEAD" || status_code == 204 || status_code == 304
+        || (status_code >= 100 && status_code < 200))
+    {
+      body_mode_ = body_length;
+      body_done_ = true;
+    }
+    else if (header_has_token(transfer_encoding, "chunked"))
+    {
+      body_mode_ = body_chunked;
+    }
+    else if (has_content_length)
+    {
+      body_mode_ = body_length;
+      body_remaining_ = content_length_;
+      body_done_ = (body_remaining_ == 0);
+    }
+    else
+    {
+      reusable_ = false;
+    }
+    return true;
+  }
+
+  void reset_body()
+  {
+    body_mode_ = body_until_eof;
+    body_remaining_ = 0;
+    body_done_ = false;
+    chunk_trailer_ = false;
+    reusable_ = false;
+#if !defined(URDL_DISABLE_ZLIB)
+    inflater_.reset();
+#endif // !defined(URDL_DISABLE_ZLIB)
+  }
+
+#if !defined(URDL_DISABLE_ZLIB)
+  // Inflates the body into buffer, reading more of it as needed, until some
+  // output is produced or the compressed data ends.
+  std::size_t read_inflated(const boost::asio::mutable_buffer& buffer,
+      boost::system::error_code& ec)
+  {
+    for (;;)
+    {
+      if (inflater_->finished())
+      {
+        // Read past anything after the compressed data, so that a persistent
+        // connection is left at the end of the body.
+        do
+          read_body_some(inflater_->input_buffer(), ec);
+        while (!ec);
+        return 0;
+      }
+
+      if (!inflater_->needs_input())
+      {
+        std::size_t length = inflater_->inflate(buffer, ec);
+        if (ec)
+          reusable_ = false;
+        if (ec || length > 0 || boost::asio::buffer_size(buffer) == 0)
+          return length;
+        continue;
+      }
+
+      std::size_t length = read_body_some(inflater_->input_buffer(), ec);
+      if (ec == boost::asio::error::eof)
+        ec = boost::asio::error::connection_reset; // Truncated stream.
+      if (ec)
+        return 0;
+      inflater_->commit_input(length);
+    }
+  }
+#endif // !defined(URDL_DISABLE_ZLIB)
+
+  // Consumes one CRLF-terminated line of chunk framing from reply_buffer_.
+  bool parse_chunk_line(std::size_t length)
+  {
+    std::string line(length, 0);
+    reply_buffer_.sgetn(&line[0], length);
+    line.resize(length - 2);
+    if (chunk_trailer_)
+    {
+      // Trailer headers are ignored; an empty line ends the body.
+      if (line.empty())
+        body_done_ = true;
+      return true;
+    }
+    if (line.empty())
+      return true; // The CRLF following the previous chunk's data.
+    std::size_t size = 0;
+    if (!parse_chunk_size(line, size))
+      return false;
+    if (size == 0)
+      chunk_trailer_ = true;
+    else
+      body_remaining_ = size;
+    return true;
+  }
+
+  template <typename MutableBufferSequence>
+  static boost::asio::mutable_buffer first_buffer(
+      const MutableBufferSequence& buffers)
+  {
+    typename MutableBufferSequence::const_iterator iter = buffers.begin();
+    typename MutableBufferSequence::const_iterator end = buffers.end();
+    for (; iter != end; ++iter)
+    {
+      boost::asio::mutable_buffer buffer(*iter);
+      if (boost::asio::buffer_size(buffer) > 0)
+        return buffer;
+    }
+    return boost::asio::mutable_buffer();
+  }
+
+  // Limits a read so that it does not run past the current body or chunk.
+  boost::asio::mutable_buffers_1 body_buffer(
+      const boost::asio::mutable_buffer& buffer) const
+  {
+    return boost::asio::buffer(buffer, body_remaining_);
+  }
+
+  void consume_body(std::size_t bytes_transferred,
+      boost::system::error_code& ec)
+  {
+    body_remaining_ -= bytes_transferred;
+    if (body_mode_ == body_length && body_remaining_ == 0)
+      body_done_ = true;
+    if (ec)
+      end_body(ec);
+  }
+
+  void end_body(boost::system::error_code& ec)
+  {
+    reusable_ = false;
+    if (ec == boost::asio::error::shut_down)
+      ec = boost::asio::error::eof;
+
+    // The connection went away before the end of the body.
+    if (ec == boost::asio::error::eof && !body_done_)
+      ec = boost::asio::error::connection_reset;
+  }
+
+  bool can_pool() const
+  {
+    return pool_ && reusable_ && body_done_ && pipelined_ == 0
+      && reply_buffer_.size() == 0
+      && socket_->lowest_layer().is_open();
+  }
+
+  template <typename MutableBufferSequence>
+  std::size_t read_raw(const MutableBufferSequence& buffers,
+      boost::system::error_code& ec)
+  {
+    // If we have any data in the reply_buffer_, return that first.
+    if (reply_buffer_.size() > 0)
+    {
+      std::size_t bytes_transferred = 0;
+      typename MutableBufferSequence::const_iterator iter = buffers.begin();
+      typename MutableBufferSequence::const_iterator end = buffers.end();
+      for (; iter != end && reply_buffer_.size() > 0; ++iter)
+      {
+        boost::asio::mutable_buffer buffer(*iter);
+        size_t length = boost::asio::buffer_size(buffer);
+        if (length > 0)
+        {
+          bytes_transferred += reply_buffer_.sgetn(
+              boost::asio::buffer_cast<char*>(buffer), length);
+        }
+      }
+      ec = boost::system::error_code();
+      return bytes_transferred;
+    }
+
+    // Otherwise we forward the call to the underlying socket.
+    std::size_t bytes_transferred = socket_->read_some(buffers, ec);
+    if (ec == boost::asio::error::shut_down)
+      ec = boost::asio::error::eof;
+    return bytes_transferred;
+  }
+
+  boost::asio::io_service& io_service_;
   boost::asio::ip::tcp::resolver resolver_;
-  Stream socket_;
+  boost::function<boost::shared_ptr<Stream>()> make_socket_;
+  boost::shared_ptr<Stream> socket_;
   option_set& options_;
   boost::asio::streambuf request_buffer_;
   boost::asio::streambuf reply_buffer_;
   std::string headers_;
+  std::string etag_;
+  std::string cache_control_;
   std::string content_type_;
   std::size_t content_length_;
   std::string location_;
+  std::string request_method_;
+  boost::shared_ptr<http::connection_pool> pool_;
+  std::string pool_key_;
+  bool persistent_;
+  bool decompress_;
+  bool reused_;
+  bool head_started_;
+  std::size_t pipelined_;
+  body_mode_t body_mode_;
+  std::size_t body_remaining_;
+  bool body_done_;
+  bool chunk_trailer_;
+  bool reusable_;
+#if !defined(URDL_DISABLE_ZLIB)
+  boost::scoped_ptr<inflater> inflater_;
+#endif // !defined(URDL_DISABLE_ZLIB)
 };
 
 } // namespace detail
@@ -0,0 +1,128 @@
+//
+// inflater.hpp
+// ~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef URDL_DETAIL_INFLATER_HPP
+#define URDL_DETAIL_INFLATER_HPP
+
+#if !defined(URDL_DISABLE_ZLIB)
+# include <cstring>
+# include <boost/asio/buffer.hpp>
+# include <boost/noncopyable.hpp>
+# include <boost/system/error_code.hpp>
+# include <zlib.h>
+#endif // !defined(URDL_DISABLE_ZLIB)
+
+#include "urdl/detail/abi_prefix.hpp"
+
+namespace urdl {
+namespace detail {
+
+#if !defined(URDL_DISABLE_ZLIB)
+// Streaming decoder for the "gzip" and "deflate" content codings. Compressed
+// bytes are read into a small fixed input buffer and inflated straight into
+// the caller's buffer, so the compressed body is never held in full.
+class inflater
+  : private boost::noncopyable
+{
+public:
+  enum { input_size = 8192 };
+
+  // "deflate" is meant to be zlib-wrapped, but some servers send a raw
+  // deflate stream; allow_raw lets the first block fall back to that.
+  explicit inflater(bool allow_raw)
+    : allow_raw_(allow_raw),
+      finished_(false),
+      first_input_(0)
+  {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // 15 + 32: maximum window, detect a gzip or zlib header automatically.
+    inflateInit2(&stream_, 15 + 32);
+  }
+
+  ~inflater()
+  {
+    inflateEnd(&stream_);
+  }
+
+  bool finished() const
+  {
+    return finished_;
+  }
+
+  bool needs_input() const
+  {
+    return !finished_ && stream_.avail_in == 0;
+  }
+
+  boost::asio::mutable_buffers_1 input_buffer()
+  {
+    return boost::asio::buffer(input_, input_size);
+  }
+
+  // Marks the first length bytes of input_buffer() as ready to inflate.
+  void commit_input(std::size_t length)
+  {
+    if (stream_.total_in == 0 && first_input_ == 0)
+      first_input_ = length;
+    stream_.next_in = reinterpret_cast<Bytef*>(input_);
+    stream_.avail_in = static_cast<uInt>(length);
+  }
+
+  // Inflates pending input into buffer, returning the number of bytes
+  // produced. This may be zero when more input is needed.
+  std::size_t inflate(const boost::asio::mutable_buffer& buffer,
+      boost::system::error_code& ec)
+  {
+    ec = boost::system::error_code();
+    stream_.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
+    stream_.avail_out = static_cast<uInt>(boost::asio::buffer_size(buffer));
+    int result = ::inflate(&stream_, Z_NO_FLUSH);
+    if (result == Z_DATA_ERROR && allow_raw_ && stream_.total_out == 0
+        && first_input_ > 0)
+    {
+      // Start over on the first block as raw deflate.
+      allow_raw_ = false;
+      inflateEnd(&stream_);
+      std::memset(&stream_, 0, sizeof(stream_));
+      inflateInit2(&stream_, -15);
+      stream_.next_in = reinterpret_cast<Bytef*>(input_);
+      stream_.avail_in = static_cast<uInt>(first_input_);
+      stream_.next_out = boost::asio::buffer_cast<Bytef*>(buffer);
+      stream_.avail_out = static_cast<uInt>(boost::asio::buffer_size(buffer));
+      result = ::inflate(&stream_, Z_NO_FLUSH);
+    }
+    std::size_t length = boost::asio::buffer_size(buffer) - stream_.avail_out;
+    if (result == Z_STREAM_END)
+    {
+      finished_ = true;
+    }
+    else if (result != Z_OK && result != Z_BUF_ERROR)
+    {
+      ec = make_error_code(boost::system::errc::bad_message);
+      finished_ = true;
+    }
+    return length;
+  }
+
+private:
+  z_stream stream_;
+  bool allow_raw_;
+  bool finished_;
+  std::size_t first_input_;
+  char input_[input_size];
+};
+#endif // !defined(URDL_DISABLE_ZLIB)
+
+} // namespace detail
+} // namespace urdl
+
+#include "urdl/detail/abi_suffix.hpp"
+
+#endif // URDL_DETAIL_INFLATER_HPP
@@ -13,7 +13,7 @@
 
 #include <algorithm>
 #include <cctype>
-#include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include "urdl/detail/abi_prefix.hpp"
@@ -50,28 +50,192 @@ inline bool is_digit(int c)
   return c >= '0' && c <= '9';
 }
 
-inline bool tolower_compare(char a, char b)
+inline char ascii_tolower(char c)
 {
-  return std::tolower(a) == std::tolower(b);
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
 }
 
-inline bool headers_equal(const std::string& a, const std::string& b)
+// A range of characters within a buffer owned by someone else, such as one
+// header value within a response head.
+class string_ref
 {
-  if (a.length() != b.length())
+public:
+  string_ref()
+    : data_(0),
+      size_(0)
+  {
+  }
+
+  string_ref(const char* data, std::size_t size)
+    : data_(data),
+      size_(size)
+  {
+  }
+
+  const char* begin() const
+  {
+    return data_;
+  }
+
+  const char* end() const
+  {
+    return data_ + size_;
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  std::string str() const
+  {
+    return std::string(data_, size_);
+  }
+
+private:
+  const char* data_;
+  std::size_t size_;
+};
+
+// Compares a header name or token against a lower case literal, ignoring the
+// case of the former.
+inline bool headers_equal(const char* begin, const char* end,
+    const char* lower)
+{
+  for (; begin != end; ++begin, ++lower)
+    if (*lower == 0 || ascii_tolower(*begin) != *lower)
+      return false;
+  return *lower == 0;
+}
+
+inline bool headers_equal(const string_ref& a, const char* lower)
+{
+  return headers_equal(a.begin(), a.end(), lower);
+}
+
+inline bool is_lws(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Checks whether a comma-separated header value such as that of Connection or
+// Transfer-Encoding contains the given lower case token, ignoring case.
+inline bool header_has_token(const string_ref& value, const char* token)
+{
+  const char* pos = value.begin();
+  for (;;)
+  {
+    const char* end = std::find(pos, value.end(), ',');
+    const char* first = pos;
+    const char* last = end;
+    while (first < last && is_lws(*first))
+      ++first;
+    while (last > first && is_lws(last[-1]))
+      --last;
+    if (headers_equal(first, last, token))
+      return true;
+    if (end == value.end())
+      return false;
+    pos = end + 1;
+  }
+}
+
+// Parses a Content-Length value. Trailing whitespace is allowed.
+inline bool parse_content_length(const string_ref& value, std::size_t& length)
+{
+  length = 0;
+  const char* iter = value.begin();
+  for (; iter != value.end() && is_digit(*iter); ++iter)
+  {
+    if (length > (~std::size_t(0) - 9) / 10)
+      return false;
+    length = length * 10 + (*iter - '0');
+  }
+  if (iter == value.begin())
     return false;
-  return std::equal(a.begin(), a.end(), b.begin(), tolower_compare);
+  for (; iter != value.end(); ++iter)
+    if (!is_lws(*iter))
+      return false;
+  return true;
 }
 
-inline void check_header(const std::string& name, const std::string& value,
-    std::string& content_type, std::size_t& content_length,
-    std::string& location)
+// The response header fields that the HTTP stream acts on, as ranges within
+// the parsed response head. A field that was not present is empty.
+struct http_head_fields
+{
+  string_ref content_type;
+  string_ref content_length;
+  string_ref location;
+  string_ref transfer_encoding;
+  string_ref connection;
+  string_ref content_encoding;
+  string_ref etag;
+  string_ref cache_control;
+
+  // Returns the field with the given name, or 0 if it is not one of the above.
+  string_ref* find(const char* begin, const char* end)
+  {
+    // Only one candidate name per length, so at most one full comparison.
+    switch (end - begin)
+    {
+    case 4:
+      return headers_equal(begin, end, "etag") ? &etag : 0;
+    case 8:
+      return headers_equal(begin, end, "location") ? &location : 0;
+    case 10:
+      return headers_equal(begin, end, "connection") ? &connection : 0;
+    case 12:
+      return headers_equal(begin, end, "content-type") ? &content_type : 0;
+    case 13:
+      return headers_equal(begin, end, "cache-control") ? &cache_control : 0;
+    case 14:
+      return headers_equal(begin, end, "content-length") ? &content_length : 0;
+    case 16:
+      return headers_equal(begin, end, "content-encoding")
+        ? &content_encoding : 0;
+    case 17:
+      return headers_equal(begin, end, "transfer-encoding")
+        ? &transfer_encoding : 0;
+    default:
+      return 0;
+    }
+  }
+};
+
+// Parses the size at the start of a chunk header line, with the trailing CRLF
+// already removed. Chunk extensions after a ';' are ignored.
+inline bool parse_chunk_size(const std::string& line, std::size_t& size)
 {
-  if (headers_equal(name, "Content-Type"))
-    content_type = value;
-  else if (headers_equal(name, "Content-Length"))
-    content_length = std::atoi(value.c_str());
-  else if (headers_equal(name, "Location"))
-    location = value;
+  size = 0;
+  std::size_t digits = 0;
+  std::string::size_type i = 0;
+  for (; i < line.length(); ++i, ++digits)
+  {
+    char c = line[i];
+    int value;
+    if (c >= '0' && c <= '9')
+      value = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      value = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      value = c - 'A' + 10;
+    else
+      break;
+    if (digits >= sizeof(std::size_t) * 2)
+      return false;
+    size = size * 16 + value;
+  }
+  if (digits == 0)
+    return false;
+  for (; i < line.length() && line[i] != ';'; ++i)
+    if (line[i] != ' ' && line[i] != '\t')
+      return false;
+  return true;
 }
 
 template <typename Iterator>
@@ -97,7 +261,6 @@ bool parse_http_status_line(Iterator begin, Iterator end,
   } state = http_version_h;
 
   Iterator iter = begin;
-  std::string reason;
   while (iter != end && state != fail)
   {
     char c = *iter++;
@@ -174,8 +337,6 @@ bool parse_http_status_line(Iterator begin, Iterator end,
         state = linefeed;
       else if (is_ctl(c))
         state = fail;
-      else
-        reason.push_back(c);
       break;
     case linefeed:
       return (c == '\n');
@@ -186,107 +347,65 @@ bool parse_http_status_line(Iterator begin, Iterator end,
   return false;
 }
 
-template <typename Iterator>
-bool parse_http_headers(Iterator begin, Iterator end,
-    std::string& content_type, std::size_t& content_length,
-    std::string& location)
+// Parses the header lines of a response head, from just after the status line
+// up to and including the blank line that ends the head. Works in place: the
+// fields refer into [begin, end), which must outlive them. Line ends are found
+// with memchr rather than one character at a time. If a header is repeated,
+// the last one wins.
+inline bool parse_http_headers(const char* begin, const char* end,
+    http_head_fields& fields)
 {
-  enum
+  fields = http_head_fields();
+  string_ref* last_field = 0;
+  const char* line = begin;
+  for (;;)
   {
-    first_header_line_start,
-    header_line_start,
-    header_lws,
-    header_name,
-    space_before_header_value,
-    header_value,
-    linefeed,
-    final_linefeed,
-    fail
-  } state = first_header_line_start;
+    const char* eol = static_cast<const char*>(
+        std::memchr(line, '\r', end - line));
+    if (eol == 0 || end - eol < 2 || eol[1] != '\n')
+      return false;
+    if (eol == line)
+      return eol + 2 == end;
 
-  Iterator iter = begin;
-  std::string reason;
-  std::string name;
-  std::string value;
-  while (iter != end && state != fail)
-  {
-    char c = *iter++;
-    switch (state)
+    const char* value;
+    if (*line == ' ' || *line == '\t')
     {
-    case first_header_line_start:
-      if (c == '\r')
-        state = final_linefeed;
-      else if (!is_char(c) || is_ctl(c) || is_tspecial(c))
-        state = fail;
-      else
-      {
-        name.push_back(c);
-        state = header_name;
-      }
-      break;
-    case header_line_start:
-      if (c == '\r')
-      {
-        check_header(name, value, content_type, content_length, location);
-        name.clear();
-        value.clear();
-        state = final_linefeed;
-      }
-      else if (c == ' ' || c == '\t')
-        state = header_lws;
-      else if (!is_char(c) || is_ctl(c) || is_tspecial(c))
-        state = fail;
-      else
-      {
-        check_header(name, value, content_type, content_length, location);
-        name.clear();
-        value.clear();
-        name.push_back(c);
-        state = header_name;
-      }
-      break;
-    case header_lws:
-      if (c == '\r')
-        state = linefeed;
-      else if (c == ' ' || c == '\t')
-        ; // Discard character.
-      else if (is_ctl(c))
-        state = fail;
-      else
-      {
-        state = header_value;
-        value.push_back(c);
-      }
-      break;
-    case header_name:
-      if (c == ':')
-        state = space_before_header_value;
-      else if (!is_char(c) || is_ctl(c) || is_tspecial(c))
-        state = fail;
-      else
-        name.push_back(c);
-      break;
-    case space_before_header_value:
-      state = (c == ' ') ? header_value : fail;
-      break;
-    case header_value:
-      if (c == '\r')
-        state = linefeed;
-      else if (is_ctl(c))
-        state = fail;
-      else
-        value.push_back(c);
-      break;
-    case linefeed:
-      state = (c == '\n') ? header_line_start : fail;
-      break;
-    case final_linefeed:
-      return (c == '\n');
-    default:
-      return false;
+      // A continuation of the previous header's value.
+      if (line == begin)
+        return false;
+      value = line;
+      if (last_field)
+        *last_field = string_ref(last_field->begin(),
+            eol - last_field->begin());
     }
+    else
+    {
+      const char* name_end = line;
+      while (name_end != eol && is_char(*name_end)
+          && !is_ctl(*name_end) && !is_tspecial(*name_end))
+        ++name_end;
+      if (name_end == line || name_end == eol || *name_end != ':')
+        return false;
+
+      value = name_end + 1;
+      while (value != eol && (*value == ' ' || *value == '\t'))
+        ++value;
+      const char* value_end = eol;
+      while (value_end != value
+          && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        --value_end;
+
+      last_field = fields.find(line, name_end);
+      if (last_field)
+        *last_field = string_ref(value, value_end - value);
+    }
+
+    for (const char* iter = value; iter != eol; ++iter)
+      if (is_ctl(*iter) && *iter != '\t')
+        return false;
+
+    line = eol + 2;
   }
-  return false;
 }
 
 } // namespace detail
@@ -0,0 +1,254 @@
+//
+// redirect_cache.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef URDL_DETAIL_REDIRECT_CACHE_HPP
+#define URDL_DETAIL_REDIRECT_CACHE_HPP
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include "urdl/url.hpp"
+#include "urdl/detail/parsers.hpp"
+
+#include "urdl/detail/abi_prefix.hpp"
+
+namespace urdl {
+namespace detail {
+
+// Process-wide cache of permanent redirects.
+//
+// A redirect is stored as a rule from one URL prefix to another. The prefixes
+// are what is left of the two URLs once the longest common tail starting at a
+// path separator is removed, so a tile server that moves every tile under
+// /tiles/ to a CDN needs only one rule, learnt from the first tile. When the
+// URLs have no such tail in common the rule matches the one URL exactly.
+class redirect_cache
+  : private boost::noncopyable
+{
+public:
+  explicit redirect_cache(
+      const boost::posix_time::time_duration& ttl
+        = boost::posix_time::hours(1),
+      std::size_t max_entries = 256)
+    : ttl_(ttl),
+      max_entries_(max_entries)
+  {
+  }
+
+  static redirect_cache& instance()
+  {
+    static redirect_cache cache;
+    return cache;
+  }
+
+  // Rewrites u into target if a rule matches it. Returns false otherwise.
+  bool find(const url& u, url& target)
+  {
+    if (!u.user_info().empty())
+      return false;
+    std::string s = key(u);
+    std::size_t authority = authority_end(s);
+    boost::posix_time::ptime now = now_utc();
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    if (entries_.empty())
+      return false;
+
+    // Try the whole URL, then each shorter prefix ending in a separator.
+    for (std::size_t length = s.size(); length > authority; --length)
+    {
+      if (length != s.size() && s[length - 1] != '/')
+        continue;
+      map_type::iterator iter = entries_.find(s.substr(0, length));
+      if (iter == entries_.end())
+        continue;
+      entry& e = iter->second;
+      if (now >= e.expires)
+      {
+        entries_.erase(iter);
+        continue;
+      }
+      if (e.exact && length != s.size())
+        continue;
+      target = url::from_string(e.target + s.substr(length));
+      return true;
+    }
+    return false;
+  }
+
+  // Records a permanent redirect from u to the location given by a response,
+  // unless its Cache-Control header forbids it.
+  void store(const url& u, const std::string& location,
+      const std::string& cache_control)
+  {
+    boost::posix_time::time_duration ttl = ttl_;
+    if (!cacheable(cache_control, ttl))
+      return;
+
+    boost::system::error_code ec;
+    url target = url::from_string(location, ec);
+    if (ec || target.protocol().empty() || target.host().empty()
+        || !u.user_info().empty() || !target.user_info().empty())
+      return;
+
+    std::string from = key(u);
+    std::string to = key(target);
+    if (from == to)
+      return;
+
+    // Find the longest common tail that starts just after a '/' within both
+    // paths. The '/' itself must be part of the tail too.
+    std::size_t from_authority = authority_end(from);
+    std::size_t to_authority = authority_end(to);
+    std::size_t common = 0;
+    while (common < from.size() - from_authority
+        && common < to.size() - to_authority
+        && from[from.size() - common - 1] == to[to.size() - common - 1])
+      ++common;
+    std::size_t tail = 0;
+    for (std::size_t i = from.size() - common; i < from.size(); ++i)
+    {
+      if (from[i] == '/')
+      {
+        tail = from.size() - i - 1;
+        break;
+      }
+    }
+
+    entry e;
+    e.target = to.substr(0, to.size() - tail);
+    e.exact = (tail == 0);
+    e.expires = now_utc() + ttl;
+
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    entries_[from.substr(0, from.size() - tail)] = e;
+    if (entries_.size() > max_entries_)
+      purge(now_utc());
+  }
+
+  // Forgets the rule that find() used to rewrite u.
+  void erase(const url& u)
+  {
+    std::string s = key(u);
+    std::size_t authority = authority_end(s);
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    for (std::size_t length = s.size(); length > authority; --length)
+    {
+      if (length != s.size() && s[length - 1] != '/')
+        continue;
+      map_type::iterator iter = entries_.find(s.substr(0, length));
+      if (iter != entries_.end()
+          && (!iter->second.exact || length == s.size()))
+      {
+        entries_.erase(iter);
+        return;
+      }
+    }
+  }
+
+  void clear()
+  {
+    map_type entries;
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    entries.swap(entries_);
+  }
+
+private:
+  struct entry
+  {
+    std::string target;
+    bool exact;
+    boost::posix_time::ptime expires;
+  };
+
+  typedef std::map<std::string, entry> map_type;
+
+  static std::string key(const url& u)
+  {
+    return u.to_string(url::protocol_component | url::host_component
+        | url::port_component | url::path_component | url::query_component);
+  }
+
+  // The length of the "protocol://host:port" part of a key.
+  static std::size_t authority_end(const std::string& s)
+  {
+    std::string::size_type start = s.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    std::string::size_type end = s.find_first_of("/?", start);
+    return end == std::string::npos ? s.size() : end;
+  }
+
+  static boost::posix_time::ptime now_utc()
+  {
+    return boost::posix_time::microsec_clock::universal_time();
+  }
+
+  // Applies the directives that stop a redirect being reused or shorten how
+  // long it may be.
+  static bool cacheable(const std::string& cache_control,
+      boost::posix_time::time_duration& ttl)
+  {
+    string_ref value(cache_control.data(), cache_control.size());
+    if (header_has_token(value, "no-store")
+        || header_has_token(value, "no-cache")
+        || header_has_token(value, "private"))
+      return false;
+
+    std::string::size_type pos = 0;
+    while ((pos = cache_control.find('=', pos)) != std::string::npos)
+    {
+      std::string::size_type name = pos;
+      while (name > 0 && cache_control[name - 1] != ','
+          && cache_control[name - 1] != ' ')
+        --name;
+      if (headers_equal(cache_control.data() + name,
+            cache_control.data() + pos, "max-age"))
+      {
+        long seconds = std::atol(cache_control.c_str() + pos + 1);
+        if (seconds <= 0)
+          return false;
+        if (boost::posix_time::seconds(seconds) < ttl)
+          ttl = boost::posix_time::seconds(seconds);
+      }
+      ++pos;
+    }
+    return true;
+  }
+
+  // Drops expired rules, or everything if the cache is still too big after
+  // that.
+  void purge(const boost::posix_time::ptime& now)
+  {
+    map_type::iterator iter = entries_.begin();
+    while (iter != entries_.end())
+    {
+      if (now >= iter->second.expires)
+        entries_.erase(iter++);
+      else
+        ++iter;
+    }
+    if (entries_.size() > max_entries_)
+      entries_.clear();
+  }
+
+  boost::posix_time::time_duration ttl_;
+  std::size_t max_entries_;
+  boost::asio::detail::mutex mutex_;
+  map_type entries_;
+};
+
+} // namespace detail
+} // namespace urdl
+
+#include "urdl/detail/abi_suffix.hpp"
+
+#endif // URDL_DETAIL_REDIRECT_CACHE_HPP
@@ -0,0 +1,240 @@
+//
+// resolver_cache.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef URDL_DETAIL_RESOLVER_CACHE_HPP
+#define URDL_DETAIL_RESOLVER_CACHE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "urdl/detail/abi_prefix.hpp"
+
+namespace urdl {
+namespace detail {
+
+// Process-wide cache of host name lookups, keyed by host and port.
+//
+// The resolver does not report record TTLs, so answers are kept for a fixed
+// time. After that they are stale: the asynchronous connect path keeps using
+// a stale answer while one background lookup replaces it, so a slow resolver
+// is only waited on when a host is new or has gone unused for a long time.
+// Failed lookups are remembered briefly so that a missing host does not cost
+// a lookup per request.
+class resolver_cache
+  : private boost::noncopyable
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints_type;
+  typedef boost::shared_ptr<const endpoints_type> endpoints_ptr;
+
+  explicit resolver_cache(
+      const boost::posix_time::time_duration& ttl
+        = boost::posix_time::seconds(60),
+      const boost::posix_time::time_duration& max_stale
+        = boost::posix_time::seconds(60),
+      const boost::posix_time::time_duration& negative_ttl
+        = boost::posix_time::seconds(5),
+      std::size_t max_entries = 1024)
+    : ttl_(ttl),
+      max_stale_(max_stale),
+      negative_ttl_(negative_ttl),
+      max_entries_(max_entries)
+  {
+  }
+
+  static resolver_cache& instance()
+  {
+    static resolver_cache cache;
+    return cache;
+  }
+
+  // Looks up a cached answer. Returns false if there is none, in which case
+  // the caller resolves the name and calls store(). Otherwise endpoints or ec
+  // hold the answer. A stale answer is only returned when allow_stale is set,
+  // and then refresh is set for the one caller that should call
+  // async_refresh().
+  bool find(const std::string& host, const std::string& port,
+      endpoints_ptr& endpoints, boost::system::error_code& ec,
+      bool allow_stale, bool& refresh)
+  {
+    refresh = false;
+    boost::posix_time::ptime now = now_utc();
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    map_type::iterator iter = entries_.find(key(host, port));
+    if (iter == entries_.end())
+      return false;
+    entry& e = iter->second;
+    if (now >= e.expires)
+    {
+      if (e.ec || !allow_stale || now >= e.expires + max_stale_)
+        return false;
+      if (!e.refreshing)
+      {
+        e.refreshing = true;
+        refresh = true;
+      }
+    }
+    endpoints = e.endpoints;
+    ec = e.ec;
+    return true;
+  }
+
+  // Records the result of a lookup.
+  void store(const std::string& host, const std::string& port,
+      const endpoints_ptr& endpoints, const boost::system::error_code& ec)
+  {
+    store(host, port, endpoints, ec, false);
+  }
+
+  // Copies the resolver's answer, alternating between address families while
+  // keeping the resolver's order within each. Connection attempts made in
+  // that order reach the other family by the second attempt if one is broken.
+  static endpoints_ptr make_endpoints(
+      boost::asio::ip::tcp::resolver::iterator iter)
+  {
+    endpoints_type preferred, other;
+    for (; iter != boost::asio::ip::tcp::resolver::iterator(); ++iter)
+    {
+      boost::asio::ip::tcp::endpoint endpoint = *iter;
+      if (preferred.empty() || endpoint.protocol() == preferred[0].protocol())
+        preferred.push_back(endpoint);
+      else
+        other.push_back(endpoint);
+    }
+    boost::shared_ptr<endpoints_type> endpoints(new endpoints_type);
+    for (std::size_t i = 0; i < preferred.size() || i < other.size(); ++i)
+    {
+      if (i < preferred.size())
+        endpoints->push_back(preferred[i]);
+      if (i < other.size())
+        endpoints->push_back(other[i]);
+    }
+    return endpoints;
+  }
+
+  // Looks the name up again in the background. Until it completes, callers
+  // keep getting the stale answer.
+  void async_refresh(boost::asio::io_service& io_service,
+      const std::string& host, const std::string& port)
+  {
+    boost::shared_ptr<boost::asio::ip::tcp::resolver> resolver(
+        new boost::asio::ip::tcp::resolver(io_service));
+    boost::asio::ip::tcp::resolver::query query(host, port);
+    resolver->async_resolve(query,
+        boost::bind(&resolver_cache::handle_refresh, this, resolver,
+          host, port, boost::asio::placeholders::error,
+          boost::asio::placeholders::iterator));
+  }
+
+  void clear()
+  {
+    map_type entries;
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    entries.swap(entries_);
+  }
+
+private:
+  struct entry
+  {
+    endpoints_ptr endpoints;
+    boost::system::error_code ec;
+    boost::posix_time::ptime expires;
+    bool refreshing;
+  };
+
+  typedef std::map<std::string, entry> map_type;
+
+  static std::string key(const std::string& host, const std::string& port)
+  {
+    return host + ":" + port;
+  }
+
+  static boost::posix_time::ptime now_utc()
+  {
+    return boost::posix_time::microsec_clock::universal_time();
+  }
+
+  void handle_refresh(boost::shared_ptr<boost::asio::ip::tcp::resolver>,
+      const std::string& host, const std::string& port,
+      const boost::system::error_code& ec,
+      boost::asio::ip::tcp::resolver::iterator iter)
+  {
+    store(host, port, make_endpoints(iter), ec, true);
+  }
+
+  void store(const std::string& host, const std::string& port,
+      const endpoints_ptr& endpoints, const boost::system::error_code& ec,
+      bool refreshed)
+  {
+    boost::posix_time::ptime now = now_utc();
+    std::string k = key(host, port);
+    boost::asio::detail::mutex::scoped_lock lock(mutex_);
+    map_type::iterator iter = entries_.find(k);
+    if (iter != entries_.end())
+    {
+      iter->second.refreshing = false;
+
+      // If a refresh fails, keep serving the old answer rather than failing
+      // every request. It runs out once it is too stale.
+      if (refreshed && ec && !iter->second.ec)
+        return;
+    }
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    entry& e = entries_[k];
+    e.endpoints = endpoints;
+    e.ec = ec;
+    e.expires = now + (ec ? negative_ttl_ : ttl_);
+    e.refreshing = false;
+
+    if (entries_.size() > max_entries_)
+      purge(now);
+  }
+
+  // Drops entries that can no longer be used, or everything if the cache is
+  // still too big after that.
+  void purge(const boost::posix_time::ptime& now)
+  {
+    map_type::iterator iter = entries_.begin();
+    while (iter != entries_.end())
+    {
+      if (now >= iter->second.expires + max_stale_)
+        entries_.erase(iter++);
+      else
+        ++iter;
+    }
+    if (entries_.size() > max_entries_)
+      entries_.clear();
+  }
+
+  boost::posix_time::time_duration ttl_;
+  boost::posix_time::time_duration max_stale_;
+  boost::posix_time::time_duration negative_ttl_;
+  std::size_t max_entries_;
+  boost::asio::detail::mutex mutex_;
+  map_type entries_;
+};
+
+} // namespace detail
+} // namespace urdl
+
+#include "urdl/detail/abi_suffix.hpp"
+
+#endif // URDL_DETAIL_RESOLVER_CACHE_HPP
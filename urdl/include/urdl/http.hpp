@@ -12,6 +12,7 @@
 #define URDL_HTTP_HPP
 
 #include <string>
+#include <boost/shared_ptr.hpp>
 #include <boost/system/error_code.hpp>
 #include "urdl/detail/config.hpp"
 
@@ -20,6 +21,8 @@
 namespace urdl {
 namespace http {
 
+class connection_pool;
+
 /// Gets the error category for HTTP errors.
 /**
  * @returns The @c boost::system::error_category used for HTTP errors.
@@ -412,6 +415,232 @@ private:
   std::string value_;
 };
 
+/// Option to enable HTTP/1.1 persistent connections.
+/**
+ * @par Remarks
+ * The default is to send HTTP/1.0 requests with "Connection: close", so that
+ * each request opens a new connection. When the option holds a
+ * @c connection_pool, requests are sent as HTTP/1.1, the response body is
+ * delimited using Content-Length or chunked transfer coding, and a connection
+ * whose body has been read to the end is returned to the pool on close.
+ *
+ * @par Example
+ * To enable persistent connections for an object of class
+ * @c urdl::read_stream:
+ * @code
+ * boost::shared_ptr<urdl::http::connection_pool> pool(
+ *     new urdl::http::connection_pool);
+ * urdl::read_stream stream(io_service);
+ * stream.set_option(urdl::http::keep_alive(pool));
+ * stream.open("http://www.boost.org");
+ * @endcode
+ *
+ * @par Requirements
+ * @e Header: @c <urdl/http.hpp> @n
+ * @e Namespace: @c urdl::http
+ */
+class keep_alive
+{
+public:
+  /// Constructs an object of class @c keep_alive.
+  /**
+   * @par Remarks
+   * Postcondition: <tt>!value()</tt>.
+   */
+  keep_alive()
+    : value_()
+  {
+  }
+
+  /// Constructs an object of class @c keep_alive.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  explicit keep_alive(const boost::shared_ptr<connection_pool>& v)
+    : value_(v)
+  {
+  }
+
+  /// Gets the value of the option.
+  /**
+   * @returns The value of the option.
+   */
+  boost::shared_ptr<connection_pool> value() const
+  {
+    return value_;
+  }
+
+  /// Sets the value of the option.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  void value(const boost::shared_ptr<connection_pool>& v)
+  {
+    value_ = v;
+  }
+
+private:
+  boost::shared_ptr<connection_pool> value_;
+};
+
+/// Option to request compressed response bodies.
+/**
+ * @par Remarks
+ * When enabled, requests carry an "Accept-Encoding: gzip, deflate" header and
+ * a response sent with either content coding is inflated as it is read, so
+ * @c read_some and @c async_read_some return the decoded bytes. The default
+ * is disabled. @c content_length() still reports the Content-Length header,
+ * which is the size of the compressed body. Has no effect if urdl was built
+ * with URDL_DISABLE_ZLIB defined.
+ *
+ * @par Example
+ * To enable compression for an object of class @c urdl::read_stream:
+ * @code
+ * urdl::read_stream stream(io_service);
+ * stream.set_option(urdl::http::decompress(true));
+ * stream.open("http://www.boost.org");
+ * @endcode
+ *
+ * @par Requirements
+ * @e Header: @c <urdl/http.hpp> @n
+ * @e Namespace: @c urdl::http
+ */
+class decompress
+{
+public:
+  /// Constructs an object of class @c decompress.
+  /**
+   * @par Remarks
+   * Postcondition: <tt>value() == false</tt>.
+   */
+  decompress()
+    : value_(false)
+  {
+  }
+
+  /// Constructs an object of class @c decompress.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  explicit decompress(bool v)
+    : value_(v)
+  {
+  }
+
+  /// Gets the value of the option.
+  /**
+   * @returns The value of the option.
+   */
+  bool value() const
+  {
+    return value_;
+  }
+
+  /// Sets the value of the option.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  void value(bool v)
+  {
+    value_ = v;
+  }
+
+private:
+  bool value_;
+};
+
+/// Option to remember permanent HTTP redirects.
+/**
+ * @par Remarks
+ * When enabled, a "301 Moved Permanently" response is remembered in a cache
+ * shared by the whole process, and later opens of matching URLs go straight
+ * to the new location without asking the original server first. The default
+ * is disabled.
+ *
+ * A redirect is remembered as a rule between URL prefixes that end at a path
+ * separator: if <tt>http://a/tiles/1/2/3.json</tt> is moved to
+ * <tt>http://b/v2/1/2/3.json</tt>, then any URL beginning with
+ * <tt>http://a/tiles/</tt> is sent to the same place under
+ * <tt>http://b/v2/</tt>. If opening a rewritten URL fails, the rule is
+ * dropped and the original URL is opened instead. Redirects sent with
+ * "Cache-Control: no-store" or "no-cache" are not remembered, and a max-age
+ * directive limits how long one is kept.
+ *
+ * @par Example
+ * To remember permanent redirects for an object of class
+ * @c urdl::read_stream:
+ * @code
+ * urdl::read_stream stream(io_service);
+ * stream.set_option(urdl::http::cache_redirects(true));
+ * stream.open("http://www.boost.org");
+ * @endcode
+ *
+ * @par Requirements
+ * @e Header: @c <urdl/http.hpp> @n
+ * @e Namespace: @c urdl::http
+ */
+class cache_redirects
+{
+public:
+  /// Constructs an object of class @c cache_redirects.
+  /**
+   * @par Remarks
+   * Postcondition: <tt>value() == false</tt>.
+   */
+  cache_redirects()
+    : value_(false)
+  {
+  }
+
+  /// Constructs an object of class @c cache_redirects.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  explicit cache_redirects(bool v)
+    : value_(v)
+  {
+  }
+
+  /// Gets the value of the option.
+  /**
+   * @returns The value of the option.
+   */
+  bool value() const
+  {
+    return value_;
+  }
+
+  /// Sets the value of the option.
+  /**
+   * @param v The desired value for the option.
+   *
+   * @par Remarks
+   * Postcondition: <tt>value() == v</tt>
+   */
+  void value(bool v)
+  {
+    value_ = v;
+  }
+
+private:
+  bool value_;
+};
+
 namespace errc {
 
 /// HTTP error codes.
@@ -11,6 +11,8 @@
 #ifndef URDL_IMPL_ISTREAMBUF_IPP
 #define URDL_IMPL_ISTREAMBUF_IPP
 
+#include <algorithm>
+#include <vector>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/system/system_error.hpp>
@@ -24,17 +26,20 @@ namespace urdl {
 struct istreambuf::body
 {
   enum { putback_max = 8 };
-  enum { buffer_size = 512 };
+  enum { default_buffer_size = 512 };
 
   body()
-    : read_stream_(io_service_),
+    : get_buffer_(putback_max + default_buffer_size),
+      buffer_size_(default_buffer_size),
+      read_stream_(io_service_),
       timer_(io_service_),
       open_timeout_(300 * 1000),
       read_timeout_(300 * 1000)
   {
   }
 
-  boost::array<char, buffer_size> get_buffer_;
+  std::vector<char> get_buffer_;
+  std::size_t buffer_size_;
   boost::asio::io_service io_service_;
   boost::system::error_code error_;
   read_stream read_stream_;
@@ -174,6 +179,16 @@ void istreambuf::read_timeout(std::size_t milliseconds)
   body_->read_timeout_ = milliseconds;
 }
 
+std::size_t istreambuf::buffer_size() const
+{
+  return body_->buffer_size_;
+}
+
+void istreambuf::buffer_size(std::size_t bytes)
+{
+  body_->buffer_size_ = std::max<std::size_t>(bytes, 1);
+}
+
 std::string istreambuf::content_type() const
 {
   return body_->read_stream_.content_type();
@@ -192,12 +207,77 @@ std::string istreambuf::headers() const
 std::streambuf::int_type istreambuf::underflow()
 {
   if (gptr() == egptr())
+  {
+    // Any unread content has been consumed, so the buffer may be resized.
+    if (body_->get_buffer_.size() != body::putback_max + body_->buffer_size_)
+      body_->get_buffer_.resize(body::putback_max + body_->buffer_size_);
+
+    char* base = &body_->get_buffer_[0];
+    std::size_t bytes_transferred = read_some(
+        base + body::putback_max, body_->buffer_size_);
+    if (bytes_transferred == 0)
+      return traits_type::eof();
+
+    setg(base, base + body::putback_max,
+        base + body::putback_max + bytes_transferred);
+    return traits_type::to_int_type(*gptr());
+  }
+  else
+  {
+    return traits_type::eof();
+  }
+}
+
+std::streamsize istreambuf::xsgetn(char_type* s, std::streamsize n)
+{
+  std::streamsize total = 0;
+  while (total < n)
+  {
+    std::streamsize available = egptr() - gptr();
+    if (available > 0)
+    {
+      std::streamsize length = (std::min)(available, n - total);
+      traits_type::copy(s + total, gptr(), static_cast<std::size_t>(length));
+      gbump(static_cast<int>(length));
+      total += length;
+    }
+    else if (static_cast<std::size_t>(n - total) >= body_->buffer_size_)
+    {
+      std::size_t bytes_transferred = read_some(
+          s + total, static_cast<std::size_t>(n - total));
+      if (bytes_transferred == 0)
+        break;
+      total += bytes_transferred;
+    }
+    else if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+    {
+      break;
+    }
+  }
+  return total;
+}
+
+const boost::system::error_code& istreambuf::error() const
+{
+  return body_->error_;
+}
+
+void istreambuf::init_buffers()
+{
+  char* base = &body_->get_buffer_[0];
+  setg(base, base + body::putback_max, base + body::putback_max);
+}
+
+// Reads from the underlying transport, subject to the read timeout. Returns 0
+// at the end of the content and throws on any other error.
+std::size_t istreambuf::read_some(char* data, std::size_t length)
+{
+  for (;;)
   {
     std::size_t bytes_transferred = 0;
     detail::istreambuf_read_handler rh
       = { body_->error_, bytes_transferred, body_->timer_ };
-    body_->read_stream_.async_read_some(boost::asio::buffer(
-          boost::asio::buffer(body_->get_buffer_) + body::putback_max), rh);
+    body_->read_stream_.async_read_some(boost::asio::buffer(data, length), rh);
 
     detail::istreambuf_timeout_handler th = { body_->read_stream_ };
     body_->timer_.expires_from_now(
@@ -215,32 +295,14 @@ std::streambuf::int_type istreambuf::underflow()
       if (body_->error_ == boost::asio::error::eof)
       {
         body_->error_ = boost::system::error_code();
-        return traits_type::eof();
+        return bytes_transferred;
       }
       boost::throw_exception(boost::system::system_error(body_->error_));
     }
 
-    setg(body_->get_buffer_.begin(),
-        body_->get_buffer_.begin() + body::putback_max,
-        body_->get_buffer_.begin() + body::putback_max + bytes_transferred);
-    return traits_type::to_int_type(*gptr());
+    if (bytes_transferred > 0)
+      return bytes_transferred;
   }
-  else
-  {
-    return traits_type::eof();
-  }
-}
-
-const boost::system::error_code& istreambuf::error() const
-{
-  return body_->error_;
-}
-
-void istreambuf::init_buffers()
-{
-  setg(body_->get_buffer_.begin(),
-      body_->get_buffer_.begin() + body::putback_max,
-      body_->get_buffer_.begin() + body::putback_max);
 }
 
 } // namespace urdl
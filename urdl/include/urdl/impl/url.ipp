@@ -11,6 +11,7 @@
 #ifndef URDL_URL_IPP
 #define URDL_URL_IPP
 
+#include <algorithm>
 #include <cstring>
 #include <cctype>
 #include <cstdlib>
@@ -237,6 +238,25 @@ url url::from_string(const std::string& s)
   return from_string(s.c_str());
 }
 
+void url::set_target(const char* s, std::size_t length)
+{
+  const char* end = s + length;
+  const char* query = std::find(s, end, '?');
+  const char* fragment = std::find(s, end, '#');
+  if (query > fragment)
+    query = fragment;
+
+  path_.assign(s, query);
+  if (path_.empty())
+    path_ = "/";
+  query_.clear();
+  fragment_.clear();
+  if (query != fragment)
+    query_.assign(query + 1, fragment);
+  if (fragment != end)
+    fragment_.assign(fragment + 1, end);
+}
+
 bool url::unescape_path(const std::string& in, std::string& out)
 {
   out.clear();
@@ -12,6 +12,8 @@
 #define URDL_ISTREAM_HPP
 
 #include <istream>
+#include <limits>
+#include <string>
 #include <boost/utility/base_from_member.hpp>
 #include <boost/system/error_code.hpp>
 #include "urdl/istreambuf.hpp"
@@ -327,6 +329,73 @@ public:
     rdbuf()->read_timeout(milliseconds);
   }
 
+  /// Gets the buffer size of the stream.
+  /**
+   * @returns The maximum number of bytes read from the underlying transport
+   * into the stream buffer at a time.
+   *
+   * @par Remarks
+   * Returns @c rdbuf()->buffer_size().
+   */
+  std::size_t buffer_size() const
+  {
+    return rdbuf()->buffer_size();
+  }
+
+  /// Sets the buffer size of the stream.
+  /**
+   * @param bytes The maximum number of bytes to be read from the underlying
+   * transport into the stream buffer at a time.
+   *
+   * @par Remarks
+   * Performs @c rdbuf()->buffer_size(bytes).
+   */
+  void buffer_size(std::size_t bytes)
+  {
+    rdbuf()->buffer_size(bytes);
+  }
+
+  /// Reads the rest of the content into a string.
+  /**
+   * @param content The string to receive the content. Any previous contents
+   * are discarded.
+   *
+   * @returns @c *this.
+   *
+   * @par Remarks
+   * When @c content_length() is known, @c content is sized from it up front
+   * and the content is read straight into it, rather than being copied
+   * through the stream buffer. Sets @c eofbit, but not @c failbit, when the
+   * end of the content is reached.
+   */
+  istream& read_content(std::string& content)
+  {
+    content.clear();
+    std::size_t length = content_length();
+    if (length != (std::numeric_limits<std::size_t>::max)())
+      content.reserve(length);
+
+    while (good())
+    {
+      std::size_t size = content.size();
+      std::size_t more = content.capacity() - size;
+      if (more == 0)
+      {
+        // Stop without growing the string if the content is all there.
+        if (traits_type::eq_int_type(peek(), traits_type::eof()))
+          break;
+        more = size > buffer_size() ? size : buffer_size();
+      }
+      content.resize(size + more);
+      read(&content[size], static_cast<std::streamsize>(more));
+      content.resize(size + static_cast<std::size_t>(gcount()));
+    }
+
+    if (eof() && !bad())
+      clear(std::ios_base::eofbit);
+    return *this;
+  }
+
   /// Gets the MIME type of the content obtained from the URL.
   /**
    * @returns A string specifying the MIME type. Examples of possible return
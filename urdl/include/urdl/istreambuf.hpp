@@ -151,6 +151,26 @@ public:
    */
   URDL_DECL void read_timeout(std::size_t milliseconds);
 
+  /// Gets the buffer size of the stream buffer.
+  /**
+   * @returns The maximum number of bytes, excluding putback, that are read
+   * from the underlying transport into the stream buffer at a time.
+   */
+  URDL_DECL std::size_t buffer_size() const;
+
+  /// Sets the buffer size of the stream buffer.
+  /**
+   * @param bytes The maximum number of bytes to be read from the underlying
+   * transport into the stream buffer at a time. Takes effect the next time the
+   * buffer is refilled.
+   *
+   * @par Remarks
+   * Each refill waits on the underlying transport, so a larger buffer means
+   * fewer waits when downloading large content. Reads of at least this many
+   * bytes bypass the buffer and go straight to the caller's storage.
+   */
+  URDL_DECL void buffer_size(std::size_t bytes);
+
   /// Gets the MIME type of the content obtained from the URL.
   /**
    * @returns A string specifying the MIME type. Examples of possible return
@@ -186,6 +206,15 @@ protected:
    */
   URDL_DECL int_type underflow();
 
+  /// Overrides @c std::streambuf behaviour.
+  /**
+   * par Remarks
+   * Behaves according to the specification of @c std::streambuf::xsgetn().
+   * Once any buffered content has been consumed, requests of at least
+   * @c buffer_size() bytes are read directly into @c s.
+   */
+  URDL_DECL std::streamsize xsgetn(char_type* s, std::streamsize n);
+
   /// Gets the last error associated with the stream.
   /**
    * @returns An @c error_code corresponding to the last error from the stream.
@@ -200,6 +229,7 @@ protected:
 
 private:
   URDL_DECL void init_buffers();
+  URDL_DECL std::size_t read_some(char* data, std::size_t length);
 
   struct body;
   body* body_;
@@ -0,0 +1,305 @@
+//
+// pipeline.hpp
+// ~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef URDL_PIPELINE_HPP
+#define URDL_PIPELINE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/detail/bind_handler.hpp>
+#include <boost/noncopyable.hpp>
+#include "urdl/http.hpp"
+#include "urdl/option_set.hpp"
+#include "urdl/url.hpp"
+#include "urdl/detail/coroutine.hpp"
+#include "urdl/detail/http_read_stream.hpp"
+
+#include "urdl/detail/abi_prefix.hpp"
+
+namespace urdl {
+namespace http {
+
+/// The class @c pipeline fetches a series of URLs from one HTTP server by
+/// sending all of the requests on a single persistent connection before
+/// reading the responses in order.
+/**
+ * With a slow round trip to the server, a burst of N small requests costs
+ * about one round trip instead of N. Requests are sent as HTTP/1.1 GETs; the
+ * connection is taken from, and returned to, the @c connection_pool given by
+ * the @c urdl::http::keep_alive option if one is set.
+ *
+ * Servers may close a connection before answering every pipelined request,
+ * or may not support persistent connections at all. The completion handler
+ * reports how many responses were delivered; the requests after those should
+ * be sent again individually, for example using @c urdl::read_stream.
+ *
+ * Only the "http" protocol is supported.
+ *
+ * @par Example
+ * @code
+ * void response_handler(std::size_t index,
+ *     const boost::system::error_code& ec, std::string& content)
+ * {
+ *   if (!ec)
+ *   {
+ *     // content holds the body of the response to urls[index].
+ *   }
+ * }
+ *
+ * void get_handler(const boost::system::error_code& ec, std::size_t count)
+ * {
+ *   // Requests count onwards got no response.
+ * }
+ *
+ * ...
+ *
+ * urdl::http::pipeline pipeline(io_service);
+ * pipeline.async_get(urls, response_handler, get_handler);
+ * @endcode
+ *
+ * @par Requirements
+ * @e Header: @c <urdl/pipeline.hpp> @n
+ * @e Namespace: @c urdl::http
+ */
+class pipeline
+  : private boost::noncopyable
+{
+public:
+  /// Constructs an object of class @c pipeline.
+  /**
+   * @param io_service The @c io_service object that the pipeline will use to
+   * dispatch handlers for any asynchronous operations performed on it.
+   */
+  explicit pipeline(boost::asio::io_service& io_service)
+    : io_service_(io_service),
+      http_(io_service, options_)
+  {
+  }
+
+  /// Gets the @c io_service associated with the pipeline.
+  boost::asio::io_service& get_io_service()
+  {
+    return io_service_;
+  }
+
+  /// Sets an option to control the behaviour of the pipeline.
+  /**
+   * @param option The option to be set on the pipeline.
+   *
+   * @par Remarks
+   * Options are uniquely identified by type.
+   */
+  template <typename Option>
+  void set_option(const Option& option)
+  {
+    options_.set_option(option);
+  }
+
+  /// Sets options to control the behaviour of the pipeline.
+  /**
+   * @param options The options to be set on the pipeline.
+   */
+  void set_options(const option_set& options)
+  {
+    options_.set_options(options);
+  }
+
+  /// Gets the current value of an option that controls the behaviour of the
+  /// pipeline.
+  template <typename Option>
+  Option get_option() const
+  {
+    return options_.get_option<Option>();
+  }
+
+  /// Fetches a series of URLs over one connection.
+  /**
+   * @param urls The URLs to fetch. They must all have the protocol "http" and
+   * the same host and port. The vector is copied.
+   *
+   * @param response_handler The handler to be called once for each response,
+   * in the order of @c urls. The function signature of the handler must be:
+   * @code void response_handler(
+   *   std::size_t index, // Index into urls.
+   *   const boost::system::error_code& ec, // The HTTP status, as for
+   *                                        // urdl::read_stream::open().
+   *   std::string& content // The response body. May be swapped out.
+   * ); @endcode
+   *
+   * @param handler The handler to be called when the operation completes.
+   * The function signature of the handler must be:
+   * @code void handler(
+   *   const boost::system::error_code& ec, // Why the remaining requests got
+   *                                        // no response, if any.
+   *   std::size_t count // Number of responses delivered.
+   * ); @endcode
+   * Copies will be made of the handlers as required. Neither handler is
+   * invoked from within this function.
+   */
+  template <typename ResponseHandler, typename Handler>
+  void async_get(const std::vector<url>& urls,
+      ResponseHandler response_handler, Handler handler)
+  {
+    urls_ = urls;
+    get_coro<ResponseHandler, Handler>(this, response_handler, handler)(
+        boost::system::error_code(), 0);
+  }
+
+  /// Closes the pipeline.
+  /**
+   * @param ec Set to indicate what error occurred, if any.
+   *
+   * @par Remarks
+   * Any asynchronous operations will be cancelled, and will complete with the
+   * @c boost::asio::error::operation_aborted error.
+   */
+  boost::system::error_code close(boost::system::error_code& ec)
+  {
+    return http_.close(ec);
+  }
+
+private:
+  typedef urdl::detail::http_read_stream<
+      boost::asio::ip::tcp::socket> stream_type;
+
+  // Whether ec still leaves a response body to read: an HTTP status other
+  // than 200 rather than a transport or parse failure.
+  static bool has_body(const boost::system::error_code& ec)
+  {
+    return !ec || (ec.category() == http::error_category()
+        && ec != http::errc::malformed_status_line
+        && ec != http::errc::malformed_response_headers);
+  }
+
+  template <typename ResponseHandler, typename Handler>
+  class get_coro : urdl::detail::coroutine
+  {
+  public:
+    get_coro(pipeline* this_ptr, ResponseHandler response_handler,
+        Handler handler)
+      : this_(this_ptr),
+        response_handler_(response_handler),
+        handler_(handler),
+        index_(0)
+    {
+    }
+
+    void operator()(boost::system::error_code ec,
+        std::size_t bytes_transferred = 0)
+    {
+      URDL_CORO_BEGIN;
+
+      if (this_->urls_.empty() || !same_server())
+      {
+        ec = boost::asio::error::operation_not_supported;
+        URDL_CORO_YIELD(this_->io_service_.post(
+              boost::asio::detail::bind_handler(*this, ec, 0)));
+        handler_(ec, 0);
+        return;
+      }
+
+      URDL_CORO_YIELD(this_->http_.async_open_pipelined(this_->urls_, *this));
+
+      for (;;)
+      {
+        if (!has_body(ec))
+          break;
+        status_ = ec;
+
+        this_->content_.clear();
+        this_->content_.reserve(this_->http_.content_length());
+        for (;;)
+        {
+          URDL_CORO_YIELD(this_->http_.async_read_some(
+                boost::asio::buffer(this_->buffer_), *this));
+          this_->content_.append(this_->buffer_, bytes_transferred);
+          if (ec)
+            break;
+        }
+        if (ec != boost::asio::error::eof)
+          break;
+        ec = boost::system::error_code();
+
+        response_handler_(index_, status_, this_->content_);
+        if (++index_ == this_->urls_.size())
+          break;
+
+        URDL_CORO_YIELD(this_->http_.async_next_response(*this));
+      }
+
+      // Hands the connection back to the pool if every response was read.
+      {
+        boost::system::error_code ignored_ec;
+        this_->http_.close(ignored_ec);
+      }
+      handler_(ec, index_);
+
+      URDL_CORO_END;
+    }
+
+    friend void* asio_handler_allocate(std::size_t size,
+        get_coro<ResponseHandler, Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_allocate;
+      return asio_handler_allocate(size, &this_handler->handler_);
+    }
+
+    friend void asio_handler_deallocate(void* pointer, std::size_t size,
+        get_coro<ResponseHandler, Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_deallocate;
+      asio_handler_deallocate(pointer, size, &this_handler->handler_);
+    }
+
+    template <typename Function>
+    friend void asio_handler_invoke(const Function& function,
+        get_coro<ResponseHandler, Handler>* this_handler)
+    {
+      using boost::asio::asio_handler_invoke;
+      asio_handler_invoke(function, &this_handler->handler_);
+    }
+
+  private:
+    bool same_server() const
+    {
+      const url& first = this_->urls_.front();
+      for (std::size_t i = 0; i < this_->urls_.size(); ++i)
+      {
+        const url& u = this_->urls_[i];
+        if (u.protocol() != "http" || u.host() != first.host()
+            || u.port() != first.port())
+          return false;
+      }
+      return true;
+    }
+
+    pipeline* this_;
+    ResponseHandler response_handler_;
+    Handler handler_;
+    std::size_t index_;
+    boost::system::error_code status_;
+  };
+
+  boost::asio::io_service& io_service_;
+  option_set options_;
+  stream_type http_;
+  std::vector<url> urls_;
+  std::string content_;
+  char buffer_[8192];
+};
+
+} // namespace http
+} // namespace urdl
+
+#include "urdl/detail/abi_suffix.hpp"
+
+#endif // URDL_PIPELINE_HPP
@@ -13,6 +13,7 @@
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/asio/detail/bind_handler.hpp>
 #include <boost/throw_exception.hpp>
 #include "urdl/http.hpp"
@@ -21,6 +22,7 @@
 #include "urdl/detail/coroutine.hpp"
 #include "urdl/detail/file_read_stream.hpp"
 #include "urdl/detail/http_read_stream.hpp"
+#include "urdl/detail/redirect_cache.hpp"
 
 #if !defined(URDL_DISABLE_SSL)
 # include <boost/asio/ssl.hpp>
@@ -34,7 +36,11 @@ namespace urdl {
 /// using synchronous or asynchronous operations.
 /**
  * @par Remarks
- * Currently supported URL protocols are @c http, @c https and @c file.
+ * Currently supported URL protocols are @c http, @c https and @c file, and on
+ * platforms with UNIX domain sockets, @c http+unix. An @c http+unix URL names
+ * the socket by its percent-encoded path in place of the host, as in
+ * <tt>http+unix://%2Frun%2Ftiles.sock/path</tt>, and otherwise behaves like
+ * @c http.
  *
  * The class @c read_stream meets the type requirements for @c SyncReadStream
  * and @c AsyncReadStream, as defined in the Boost.Asio documentation. This
@@ -112,6 +118,9 @@ public:
     : io_service_(io_service),
       file_(io_service, options_),
       http_(io_service, options_),
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+      http_local_(io_service, options_),
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
       ssl_context_(io_service, boost::asio::ssl::context::sslv23),
       https_(io_service, options_, ssl_context_),
@@ -225,6 +234,10 @@ public:
       return file_.is_open();
     case http:
       return http_.is_open();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.is_open();
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.is_open();
@@ -288,6 +301,7 @@ public:
   {
     url tmp_url = u;
     std::size_t redirects = 0;
+    bool rewritten = find_redirect(u, tmp_url);
     for (;;)
     {
       if (tmp_url.protocol() == "file")
@@ -299,37 +313,27 @@ public:
       {
         protocol_ = http;
         http_.open(tmp_url, ec);
-        if (ec == http::errc::moved_permanently || ec == http::errc::found)
-        {
-          std::size_t max_redirects = options_.get_option<
-              urdl::http::max_redirects>().value();
-          if (redirects < max_redirects)
-          {
-            ++redirects;
-            tmp_url = http_.location();
-            http_.close(ec);
-            continue;
-          }
-        }
+        if (retry_open(http_, u, tmp_url, rewritten, redirects, ec))
+          continue;
         return ec;
       }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+      else if (tmp_url.protocol() == "http+unix")
+      {
+        protocol_ = http_local;
+        http_local_.open(tmp_url, ec);
+        if (retry_open(http_local_, u, tmp_url, rewritten, redirects, ec))
+          continue;
+        return ec;
+      }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
       else if (tmp_url.protocol() == "https")
       {
         protocol_ = https;
         https_.open(tmp_url, ec);
-        if (ec == http::errc::moved_permanently || ec == http::errc::found)
-        {
-          std::size_t max_redirects = options_.get_option<
-              urdl::http::max_redirects>().value();
-          if (redirects < max_redirects)
-          {
-            ++redirects;
-            tmp_url = https_.location();
-            https_.close(ec);
-            continue;
-          }
-        }
+        if (retry_open(https_, u, tmp_url, rewritten, redirects, ec))
+          continue;
         return ec;
       }
 #endif // !defined(URDL_DISABLE_SSL)
@@ -414,6 +418,10 @@ public:
       return file_.close(ec);
     case http:
       return http_.close(ec);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.close(ec);
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.close(ec);
@@ -443,6 +451,10 @@ public:
       return std::string();
     case http:
       return http_.content_type();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.content_type();
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.content_type();
@@ -466,6 +478,10 @@ public:
       return ~std::size_t(0);
     case http:
       return http_.content_length();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.content_length();
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.content_length();
@@ -489,6 +505,10 @@ public:
       return std::string();
     case http:
       return http_.headers();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.headers();
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.headers();
@@ -584,6 +604,10 @@ public:
       return file_.read_some(buffers, ec);
     case http:
       return http_.read_some(buffers, ec);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      return http_local_.read_some(buffers, ec);
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       return https_.read_some(buffers, ec);
@@ -647,6 +671,11 @@ public:
     case http:
       http_.async_read_some(buffers, handler);
       break;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    case http_local:
+      http_local_.async_read_some(buffers, handler);
+      break;
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
     case https:
       https_.async_read_some(buffers, handler);
@@ -661,13 +690,63 @@ public:
   }
 
 private:
+  // Rewrites u using a remembered permanent redirect, if that is enabled.
+  bool find_redirect(const url& u, url& target)
+  {
+    if (!options_.get_option<http::cache_redirects>().value())
+      return false;
+    return detail::redirect_cache::instance().find(u, target);
+  }
+
+  // Works out whether an open of current, which began as an open of u, should
+  // be retried at another URL: the new location of a moved resource, or u
+  // itself if a remembered redirect led to a failure. Returns false if ec is
+  // the final result.
+  template <typename Stream>
+  bool retry_open(Stream& stream, const url& u, url& current,
+      bool& rewritten, std::size_t& redirects, boost::system::error_code& ec)
+  {
+    bool redirect = (ec == http::errc::moved_permanently
+        || ec == http::errc::found);
+    bool cache = options_.get_option<http::cache_redirects>().value();
+    if (cache && ec == http::errc::moved_permanently)
+    {
+      detail::redirect_cache::instance().store(current,
+          stream.location(), stream.cache_control());
+    }
+
+    if (rewritten && ec && !redirect
+        && ec != boost::asio::error::operation_aborted)
+    {
+      detail::redirect_cache::instance().erase(u);
+      rewritten = false;
+      current = u;
+    }
+    else if (redirect && redirects < options_.get_option<
+        urdl::http::max_redirects>().value())
+    {
+      ++redirects;
+      current = stream.location();
+    }
+    else
+    {
+      return false;
+    }
+
+    stream.close(ec);
+    return true;
+  }
+
   template <typename Handler>
   class open_coro : detail::coroutine
   {
   public:
     open_coro(read_stream* this_ptr, const url& u, Handler handler)
       : this_(this_ptr),
+        original_url_(u),
         url_(u),
+        rewritten_(false),
+        redirects_(0),
         handler_(handler)
     {
     }
@@ -676,6 +755,8 @@ private:
     {
       URDL_CORO_BEGIN;
 
+      rewritten_ = this_->find_redirect(original_url_, url_);
+
       for (;;)
       {
         if (url_.protocol() == "file")
@@ -689,26 +770,32 @@ private:
         {
           this_->protocol_ = http;
           URDL_CORO_YIELD(this_->http_.async_open(url_, *this));
-          if (ec == http::errc::moved_permanently || ec == http::errc::found)
-          {
-            url_ = this_->http_.location();
-            this_->http_.close(ec);
+          if (this_->retry_open(this_->http_, original_url_, url_,
+                rewritten_, redirects_, ec))
+            continue;
+          handler_(ec);
+          return;
+        }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        else if (url_.protocol() == "http+unix")
+        {
+          this_->protocol_ = http_local;
+          URDL_CORO_YIELD(this_->http_local_.async_open(url_, *this));
+          if (this_->retry_open(this_->http_local_, original_url_, url_,
+                rewritten_, redirects_, ec))
             continue;
-          }
           handler_(ec);
           return;
         }
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
         else if (url_.protocol() == "https")
         {
           this_->protocol_ = https;
           URDL_CORO_YIELD(this_->https_.async_open(url_, *this));
-          if (ec == http::errc::moved_permanently || ec == http::errc::found)
-          {
-            url_ = this_->https_.location();
-            this_->https_.close(ec);
+          if (this_->retry_open(this_->https_, original_url_, url_,
+                rewritten_, redirects_, ec))
             continue;
-          }
           handler_(ec);
           return;
         }
@@ -749,7 +836,10 @@ private:
 
   private:
     read_stream* this_;
+    url original_url_;
     url url_;
+    bool rewritten_;
+    std::size_t redirects_;
     Handler handler_;
   };
 
@@ -759,13 +849,17 @@ private:
   option_set options_;
   detail::file_read_stream file_;
   detail::http_read_stream<boost::asio::ip::tcp::socket> http_;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  detail::http_read_stream<
+      boost::asio::local::stream_protocol::socket> http_local_;
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
 #if !defined(URDL_DISABLE_SSL)
   boost::asio::ssl::context ssl_context_;
   detail::http_read_stream<
       boost::asio::ssl::stream<
         boost::asio::ip::tcp::socket> > https_;
 #endif // !defined(URDL_DISABLE_SSL)
-  enum { unknown, file, http, https } protocol_;
+  enum { unknown, file, http, http_local, https } protocol_;
 };
 
 } // namespace urdl
@@ -236,6 +236,20 @@ public:
   URDL_DECL static url from_string(const std::string& s,
       boost::system::error_code& ec);
 
+  /// Replaces the path, query and fragment components of the URL.
+  /**
+   * @param s A string of the form @c path[?query][#fragment], where the path
+   * begins with a '/'.
+   *
+   * @param length The number of characters in @c s.
+   *
+   * @par Remarks
+   * The protocol, user info, host and port components are left untouched and
+   * the path is not validated. This allows many URLs that differ only in
+   * their path to be generated from one parsed URL without reparsing it.
+   */
+  URDL_DECL void set_target(const char* s, std::size_t length);
+
   /// Compares two @c url objects for equality.
   friend URDL_DECL bool operator==(const url& a, const url& b);
 
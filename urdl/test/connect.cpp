@@ -0,0 +1,327 @@
+//
+// connect.cpp
+// ~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "urdl/detail/connect.hpp"
+
+#include "unit_test.hpp"
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+typedef boost::asio::ip::tcp::endpoint endpoint_type;
+typedef urdl::detail::resolver_cache resolver_cache;
+
+namespace {
+
+// A loopback port that refuses connections.
+endpoint_type refusing_endpoint()
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      endpoint_type(boost::asio::ip::address_v4::loopback(), 0));
+  endpoint_type endpoint = acceptor.local_endpoint();
+  acceptor.close();
+  return endpoint;
+}
+
+// A loopback port that never answers: its accept queue is kept full, so
+// further connection requests are dropped. The connects that fill it stay
+// outstanding, so tests using one run the io_service only until their
+// handler is called.
+class silent_server
+{
+public:
+  explicit silent_server(boost::asio::io_service& io_service)
+    : acceptor_(io_service)
+  {
+    endpoint_type endpoint(boost::asio::ip::address_v4::loopback(), 0);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.bind(endpoint);
+    acceptor_.listen(0);
+    for (int i = 0; i < 4; ++i)
+    {
+      boost::shared_ptr<boost::asio::ip::tcp::socket> socket(
+          new boost::asio::ip::tcp::socket(io_service));
+      socket->async_connect(acceptor_.local_endpoint(),
+          boost::bind(&silent_server::ignore, _1));
+      fillers_.push_back(socket);
+    }
+    io_service.poll();
+  }
+
+  endpoint_type endpoint() const
+  {
+    return acceptor_.local_endpoint();
+  }
+
+private:
+  static void ignore(const boost::system::error_code&)
+  {
+  }
+
+  boost::asio::ip::tcp::acceptor acceptor_;
+  std::vector<boost::shared_ptr<boost::asio::ip::tcp::socket> > fillers_;
+};
+
+resolver_cache::endpoints_ptr make_endpoints(const endpoint_type& first,
+    const endpoint_type& second)
+{
+  boost::shared_ptr<resolver_cache::endpoints_type> endpoints(
+      new resolver_cache::endpoints_type);
+  endpoints->push_back(first);
+  endpoints->push_back(second);
+  return endpoints;
+}
+
+// Gives a host name to a pair of endpoints through the resolver cache.
+urdl::url cached_url(const std::string& host, const endpoint_type& first,
+    const endpoint_type& second)
+{
+  std::string port = boost::lexical_cast<std::string>(second.port());
+  resolver_cache::instance().store(host, port,
+      make_endpoints(first, second), boost::system::error_code());
+  return urdl::url::from_string("http://" + host + ":" + port + "/");
+}
+
+struct connect_handler
+{
+  boost::system::error_code* ec_;
+  bool* called_;
+
+  void operator()(const boost::system::error_code& ec)
+  {
+    *ec_ = ec;
+    *called_ = true;
+  }
+};
+
+void close_socket(boost::asio::ip::tcp::socket* socket,
+    const boost::system::error_code& ec)
+{
+  if (!ec)
+    socket->close();
+}
+
+// Checks that socket is connected to the given acceptor by sending a byte.
+void check_connected(boost::asio::ip::tcp::socket& socket,
+    boost::asio::ip::tcp::acceptor& acceptor)
+{
+  boost::system::error_code ec;
+  BOOST_CHECK(socket.remote_endpoint(ec) == acceptor.local_endpoint());
+  BOOST_CHECK(!ec);
+
+  boost::asio::ip::tcp::socket peer(acceptor.get_io_service());
+  acceptor.accept(peer, ec);
+  BOOST_CHECK(!ec);
+  boost::asio::write(socket, boost::asio::buffer("x", 1), ec);
+  BOOST_CHECK(!ec);
+  char c = 0;
+  peer.read_some(boost::asio::buffer(&c, 1), ec);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(c == 'x');
+}
+
+boost::posix_time::ptime now()
+{
+  return boost::posix_time::microsec_clock::universal_time();
+}
+
+} // namespace
+
+// Test that a refused endpoint moves the race straight on to the next one.
+void connect_asynchronous_refused_test()
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      endpoint_type(boost::asio::ip::address_v4::loopback(), 0));
+
+  boost::asio::ip::tcp::socket socket(io_service);
+  socket.open(boost::asio::ip::tcp::v4());
+  boost::system::error_code ec;
+  bool called = false;
+  connect_handler handler = { &ec, &called };
+  boost::posix_time::ptime start = now();
+  urdl::detail::async_connect_endpoints(socket,
+      make_endpoints(refusing_endpoint(), acceptor.local_endpoint()),
+      handler);
+  io_service.run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(now() - start
+      < urdl::detail::connect_race<connect_handler>::delay());
+  check_connected(socket, acceptor);
+}
+
+// Test that a silent endpoint only delays the next attempt, and that the
+// later attempt's connection ends up in the caller's socket.
+void connect_asynchronous_staggered_test()
+{
+  boost::asio::io_service io_service;
+  silent_server silent(io_service);
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      endpoint_type(boost::asio::ip::address_v4::loopback(), 0));
+
+  boost::asio::ip::tcp::socket socket(io_service);
+  socket.open(boost::asio::ip::tcp::v4());
+  boost::system::error_code ec;
+  bool called = false;
+  connect_handler handler = { &ec, &called };
+  boost::posix_time::ptime start = now();
+  urdl::detail::async_connect_endpoints(socket,
+      make_endpoints(silent.endpoint(), acceptor.local_endpoint()), handler);
+  while (!called && io_service.run_one())
+    ;
+
+  boost::posix_time::time_duration elapsed = now() - start;
+  BOOST_CHECK(called);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(elapsed >= urdl::detail::connect_race<connect_handler>::delay());
+  BOOST_CHECK(elapsed < boost::posix_time::seconds(1));
+  check_connected(socket, acceptor);
+}
+
+// Test that every endpoint failing reports the last error.
+void connect_asynchronous_all_refused_test()
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::socket socket(io_service);
+  socket.open(boost::asio::ip::tcp::v4());
+  boost::system::error_code ec;
+  bool called = false;
+  connect_handler handler = { &ec, &called };
+  urdl::detail::async_connect_endpoints(socket,
+      make_endpoints(refusing_endpoint(), refusing_endpoint()), handler);
+  io_service.run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(ec == boost::asio::error::connection_refused);
+
+  called = false;
+  urdl::detail::async_connect_endpoints(socket,
+      resolver_cache::endpoints_ptr(new resolver_cache::endpoints_type),
+      handler);
+  io_service.reset();
+  io_service.run();
+  BOOST_CHECK(called);
+  BOOST_CHECK(ec == boost::asio::error::host_not_found);
+}
+
+// Test that closing the caller's socket cancels a race in progress,
+// including the attempts made on sockets of their own.
+void connect_asynchronous_cancel_test()
+{
+  boost::asio::io_service io_service;
+  silent_server silent1(io_service);
+  silent_server silent2(io_service);
+
+  boost::asio::ip::tcp::socket socket(io_service);
+  socket.open(boost::asio::ip::tcp::v4());
+  boost::system::error_code ec;
+  bool called = false;
+  connect_handler handler = { &ec, &called };
+  urdl::detail::async_connect_endpoints(socket,
+      make_endpoints(silent1.endpoint(), silent2.endpoint()), handler);
+
+  // Cancel once the second attempt is under way.
+  boost::asio::deadline_timer timer(io_service);
+  timer.expires_from_now(
+      urdl::detail::connect_race<connect_handler>::delay()
+      + boost::posix_time::milliseconds(100));
+  timer.async_wait(boost::bind(&close_socket, &socket, _1));
+  boost::posix_time::ptime start = now();
+  while (!called && io_service.run_one())
+    ;
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(ec == boost::asio::error::operation_aborted);
+  BOOST_CHECK(!socket.is_open());
+  BOOST_CHECK(now() - start < boost::posix_time::seconds(1));
+}
+
+// Test that the synchronous connect races on its own io_service and hands
+// the winning connection over to the caller's socket.
+void connect_synchronous_test()
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      endpoint_type(boost::asio::ip::address_v4::loopback(), 0));
+  boost::asio::ip::tcp::socket socket(io_service);
+  boost::asio::ip::tcp::resolver resolver(io_service);
+  boost::system::error_code ec;
+
+  urdl::url u = cached_url("refused.connect.test",
+      refusing_endpoint(), acceptor.local_endpoint());
+  urdl::detail::connect(socket, resolver, u, ec);
+  BOOST_CHECK(!ec);
+  check_connected(socket, acceptor);
+
+  silent_server silent(io_service);
+  boost::asio::ip::tcp::socket socket2(io_service);
+  u = cached_url("silent.connect.test",
+      silent.endpoint(), acceptor.local_endpoint());
+  boost::posix_time::ptime start = now();
+  urdl::detail::connect(socket2, resolver, u, ec);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(now() - start < boost::posix_time::seconds(1));
+  check_connected(socket2, acceptor);
+
+  boost::asio::ip::tcp::socket socket3(io_service);
+  u = cached_url("failed.connect.test",
+      refusing_endpoint(), refusing_endpoint());
+  urdl::detail::connect(socket3, resolver, u, ec);
+  BOOST_CHECK(ec == boost::asio::error::connection_refused);
+
+  resolver_cache::instance().clear();
+}
+
+// Test the asynchronous connect from a cached host name.
+void connect_asynchronous_cached_test()
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      endpoint_type(boost::asio::ip::address_v4::loopback(), 0));
+  boost::asio::ip::tcp::socket socket(io_service);
+  boost::asio::ip::tcp::resolver resolver(io_service);
+
+  urdl::url u = cached_url("async.connect.test",
+      refusing_endpoint(), acceptor.local_endpoint());
+  boost::system::error_code ec;
+  bool called = false;
+  connect_handler handler = { &ec, &called };
+  urdl::detail::async_connect(socket, resolver, u, handler);
+  io_service.run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(!ec);
+  check_connected(socket, acceptor);
+
+  resolver_cache::instance().clear();
+}
+
+test_suite* init_unit_test_suite(int, char*[])
+{
+  test_suite* test = BOOST_TEST_SUITE("connect");
+  test->add(BOOST_TEST_CASE(&connect_asynchronous_refused_test));
+  test->add(BOOST_TEST_CASE(&connect_asynchronous_staggered_test));
+  test->add(BOOST_TEST_CASE(&connect_asynchronous_all_refused_test));
+  test->add(BOOST_TEST_CASE(&connect_asynchronous_cancel_test));
+  test->add(BOOST_TEST_CASE(&connect_synchronous_test));
+  test->add(BOOST_TEST_CASE(&connect_asynchronous_cached_test));
+  return test;
+}
@@ -11,10 +11,12 @@
 #ifndef HTTP_SERVER_HPP
 #define HTTP_SERVER_HPP
 
+#include <cstdio>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/write.hpp>
@@ -24,26 +26,21 @@
 #include <boost/thread.hpp>
 
 // Helper class to test HTTP client functionality.
-class http_server
+template <typename Protocol>
+class basic_http_server
 {
 public:
-  typedef boost::asio::ip::tcp tcp;
-
-  http_server()
-    : acceptor_(io_service_, tcp::endpoint(
-          boost::asio::ip::address_v4::loopback(), 0)),
+  explicit basic_http_server(const typename Protocol::endpoint& endpoint)
+    : acceptor_(io_service_, endpoint),
       socket_(io_service_),
       response_delay_(0),
       content_delay_(0),
+      requests_(1),
+      reset_(false),
       success_(false)
   {
   }
 
-  unsigned short port() const
-  {
-    return acceptor_.local_endpoint().port();
-  }
-
   void start(const std::string& expected_request,
       std::size_t response_delay, const std::string& response,
       std::size_t content_delay, const std::string& content)
@@ -54,7 +51,46 @@ public:
     response_ = response;
     content_delay_ = content_delay;
     content_ = content;
-    thread_.reset(new boost::thread(boost::bind(&http_server::worker, this)));
+    requests_ = 1;
+    reset_ = false;
+    thread_.reset(new boost::thread(
+          boost::bind(&basic_http_server::worker, this)));
+  }
+
+  // Serves the same response to the given number of requests, all of which
+  // must arrive on a single connection.
+  void start_persistent(const std::string& expected_request,
+      const std::string& response, const std::string& content,
+      std::size_t requests)
+  {
+    success_ = false;
+    expected_request_ = expected_request;
+    response_delay_ = 0;
+    response_ = response;
+    content_delay_ = 0;
+    content_ = content;
+    requests_ = requests;
+    reset_ = false;
+    thread_.reset(new boost::thread(
+          boost::bind(&basic_http_server::worker, this)));
+  }
+
+  // Serves a single response on a persistent connection, then drops the
+  // connection with a reset, as a server timing out an idle connection
+  // might. The client only finds out when it next uses the connection.
+  void start_and_reset(const std::string& expected_request,
+      const std::string& response, const std::string& content)
+  {
+    success_ = false;
+    expected_request_ = expected_request;
+    response_delay_ = 0;
+    response_ = response;
+    content_delay_ = 0;
+    content_ = content;
+    requests_ = 1;
+    reset_ = true;
+    thread_.reset(new boost::thread(
+          boost::bind(&basic_http_server::worker, this)));
   }
 
   bool stop()
@@ -71,31 +107,40 @@ private:
     {
       acceptor_.accept(socket_);
 
-      // Wait for request.
-      boost::asio::streambuf buffer;
-      std::size_t size = boost::asio::read_until(socket_, buffer, "\r\n\r\n");
-      std::string request(size, 0);
-      buffer.sgetn(&request[0], size);
-      success_ = (request == expected_request_);
-
-      // Introduce a delay before sending the response.
-      boost::asio::deadline_timer timer(io_service_);
-      timer.expires_from_now(boost::posix_time::milliseconds(response_delay_));
-      timer.wait();
-
-      // Send response headers.
       boost::system::error_code ec;
-      boost::asio::write(socket_, boost::asio::buffer(response_));
-
-      // Introduce a delay before sending the content.
-      timer.expires_from_now(boost::posix_time::milliseconds(content_delay_));
-      timer.wait();
-
-      // Now we can write the content.
-      boost::asio::write(socket_, boost::asio::buffer(content_));
+      boost::asio::streambuf buffer;
+      for (std::size_t i = 0; i < requests_; ++i)
+      {
+        // Wait for request.
+        std::size_t size
+          = boost::asio::read_until(socket_, buffer, "\r\n\r\n");
+        std::string request(size, 0);
+        buffer.sgetn(&request[0], size);
+        success_ = (request == expected_request_) && (i == 0 || success_);
+
+        // Introduce a delay before sending the response.
+        boost::asio::deadline_timer timer(io_service_);
+        timer.expires_from_now(
+            boost::posix_time::milliseconds(response_delay_));
+        timer.wait();
+
+        // Send response headers.
+        boost::asio::write(socket_, boost::asio::buffer(response_));
+
+        // Introduce a delay before sending the content.
+        timer.expires_from_now(
+            boost::posix_time::milliseconds(content_delay_));
+        timer.wait();
+
+        // Now we can write the content.
+        boost::asio::write(socket_, boost::asio::buffer(content_));
+      }
 
       // We're done. Shut down the connection.
-      socket_.shutdown(tcp::socket::shutdown_both, ec);
+      if (reset_)
+        socket_.set_option(boost::asio::socket_base::linger(true, 0), ec);
+      else
+        socket_.shutdown(Protocol::socket::shutdown_both, ec);
       socket_.close(ec);
     }
     catch (std::exception&)
@@ -103,16 +148,70 @@ private:
     }
   }
 
+protected:
   boost::asio::io_service io_service_;
-  tcp::acceptor acceptor_;
-  tcp::socket socket_;
+  typename Protocol::acceptor acceptor_;
+  typename Protocol::socket socket_;
   std::string expected_request_;
   std::size_t response_delay_;
   std::string response_;
   std::size_t content_delay_;
   std::string content_;
+  std::size_t requests_;
+  bool reset_;
   boost::scoped_ptr<boost::thread> thread_;
   bool success_;
 };
 
+// Listens on an ephemeral TCP port on the loopback interface.
+class http_server
+  : public basic_http_server<boost::asio::ip::tcp>
+{
+public:
+  typedef boost::asio::ip::tcp tcp;
+
+  http_server()
+    : basic_http_server<tcp>(tcp::endpoint(
+          boost::asio::ip::address_v4::loopback(), 0))
+  {
+  }
+
+  unsigned short port() const
+  {
+    return acceptor_.local_endpoint().port();
+  }
+};
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Listens on a UNIX domain socket at the given path, which is removed again
+// when the server is destroyed.
+class local_http_server
+  : public basic_http_server<boost::asio::local::stream_protocol>
+{
+public:
+  typedef boost::asio::local::stream_protocol stream_protocol;
+
+  explicit local_http_server(const std::string& path)
+    : basic_http_server<stream_protocol>(
+        stream_protocol::endpoint(unlinked(path))),
+      path_(path)
+  {
+  }
+
+  ~local_http_server()
+  {
+    std::remove(path_.c_str());
+  }
+
+private:
+  static std::string unlinked(const std::string& path)
+  {
+    std::remove(path.c_str());
+    return path;
+  }
+
+  std::string path_;
+};
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
 #endif // HTTP_SERVER_HPP
@@ -79,6 +79,16 @@ void istream_compile_test()
   want<std::size_t>(const_istream1.read_timeout());
   istream1.read_timeout(std::size_t(123));
 
+  // buffer_size()
+
+  want<std::size_t>(const_istream1.buffer_size());
+  istream1.buffer_size(std::size_t(123));
+
+  // read_content()
+
+  std::string content;
+  want<urdl::istream&>(istream1.read_content(content));
+
   // content_type()
 
   want<std::string>(const_istream1.content_type());
@@ -203,6 +213,43 @@ void istream_http_read_timeout_test()
   BOOST_CHECK(istream1.error() == boost::system::errc::timed_out);
 }
 
+// Test reading large HTTP content, with and without a known length.
+void istream_http_read_content_test()
+{
+  for (int has_length = 0; has_length < 2; ++has_length)
+  {
+    http_server server;
+    std::string port = boost::lexical_cast<std::string>(server.port());
+
+    std::string content;
+    for (int i = 0; content.size() < 100000; ++i)
+      content += boost::lexical_cast<std::string>(i) + ",";
+
+    std::string request =
+      "GET / HTTP/1.0\r\n"
+      "Host: localhost:" + port + "\r\n"
+      "Accept: */*\r\n"
+      "Connection: close\r\n\r\n";
+    std::string response = "HTTP/1.0 200 OK\r\n";
+    if (has_length)
+      response += "Content-Length: "
+        + boost::lexical_cast<std::string>(content.size()) + "\r\n";
+    response += "Content-Type: text/plain\r\n\r\n";
+
+    server.start(request, 0, response, 0, content);
+    urdl::istream istream1;
+    istream1.buffer_size(4096);
+    istream1.open("http://localhost:" + port + "/");
+    std::string returned_content;
+    istream1.read_content(returned_content);
+    bool request_matched = server.stop();
+
+    BOOST_CHECK(request_matched);
+    BOOST_CHECK(istream1.eof() && !istream1.fail());
+    BOOST_CHECK(returned_content == content);
+  }
+}
+
 test_suite* init_unit_test_suite(int, char*[])
 {
   test_suite* test = BOOST_TEST_SUITE("istream");
@@ -211,5 +258,6 @@ test_suite* init_unit_test_suite(int, char*[])
   test->add(BOOST_TEST_CASE(&istream_http_not_found_test));
   test->add(BOOST_TEST_CASE(&istream_http_open_timeout_test));
   test->add(BOOST_TEST_CASE(&istream_http_read_timeout_test));
+  test->add(BOOST_TEST_CASE(&istream_http_read_content_test));
   return test;
 }
@@ -67,6 +67,11 @@ void istreambuf_compile_test()
   want<std::size_t>(const_istreambuf1.read_timeout());
   istreambuf1.read_timeout(std::size_t(123));
 
+  // buffer_size()
+
+  want<std::size_t>(const_istreambuf1.buffer_size());
+  istreambuf1.buffer_size(std::size_t(123));
+
   // content_type()
 
   want<std::string>(const_istreambuf1.content_type());
@@ -0,0 +1,138 @@
+//
+// pipeline.cpp
+// ~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "urdl/pipeline.hpp"
+
+#include "unit_test.hpp"
+#include "urdl/connection_pool.hpp"
+#include "http_server.hpp"
+#include <boost/asio/io_service.hpp>
+#include <vector>
+
+struct response_handler
+{
+  std::vector<std::string>& contents_;
+  void operator()(std::size_t index, const boost::system::error_code& ec,
+      std::string& content)
+  {
+    if (!ec && index == contents_.size())
+      contents_.push_back(content);
+  }
+};
+
+struct get_handler
+{
+  boost::system::error_code& ec_;
+  std::size_t& count_;
+  void operator()(const boost::system::error_code& ec, std::size_t count)
+  {
+    ec_ = ec;
+    count_ = count;
+  }
+};
+
+// Test that all responses arrive in order over one connection.
+void pipeline_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 13\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  server.start_persistent(request, response, content, 3);
+
+  boost::asio::io_service io_service;
+  boost::shared_ptr<urdl::http::connection_pool> pool(
+      new urdl::http::connection_pool);
+  urdl::http::pipeline pipeline1(io_service);
+  pipeline1.set_option(urdl::http::keep_alive(pool));
+
+  std::vector<urdl::url> urls(3, urdl::url("http://localhost:" + port + "/"));
+  std::vector<std::string> contents;
+  boost::system::error_code ec;
+  std::size_t count = 0;
+  response_handler rh = { contents };
+  get_handler gh = { ec, count };
+
+  pipeline1.async_get(urls, rh, gh);
+  io_service.run();
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(count == 3);
+  BOOST_CHECK(contents == std::vector<std::string>(3, content));
+  BOOST_CHECK(pool->idle_count() == 1);
+}
+
+// Test that a server closing the connection ends the pipeline early.
+void pipeline_connection_close_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 13\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  server.start_persistent(request, response, content, 1);
+
+  boost::asio::io_service io_service;
+  urdl::http::pipeline pipeline1(io_service);
+
+  std::vector<urdl::url> urls(3, urdl::url("http://localhost:" + port + "/"));
+  std::vector<std::string> contents;
+  boost::system::error_code ec;
+  std::size_t count = 0;
+  response_handler rh = { contents };
+  get_handler gh = { ec, count };
+
+  pipeline1.async_get(urls, rh, gh);
+  io_service.run();
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+  BOOST_CHECK(ec);
+  BOOST_CHECK(count == 1);
+  BOOST_CHECK(contents == std::vector<std::string>(1, content));
+}
+
+test_suite* init_unit_test_suite(int, char*[])
+{
+  test_suite* test = BOOST_TEST_SUITE("pipeline");
+  test->add(BOOST_TEST_CASE(&pipeline_test));
+  test->add(BOOST_TEST_CASE(&pipeline_connection_close_test));
+  return test;
+}
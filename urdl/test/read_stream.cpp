@@ -17,6 +17,7 @@
 #include "urdl/read_stream.hpp"
 
 #include "unit_test.hpp"
+#include "urdl/connection_pool.hpp"
 #include "urdl/option_set.hpp"
 #include "http_server.hpp"
 #include <boost/asio/buffer.hpp>
@@ -145,6 +146,46 @@ void read_stream_synchronous_http_test()
   BOOST_CHECK(returned_content == content);
 }
 
+// Test HTTP with header names in mixed case, unknown and repeated headers,
+// and optional whitespace around values.
+void read_stream_synchronous_http_headers_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.0\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string response =
+    "HTTP/1.0 200 OK\r\n"
+    "X-Unknown: ignored\r\n"
+    "content-length:13  \r\n"
+    "CONTENT-TYPE: text/html\r\n"
+    "Content-Type:\ttext/plain \r\n"
+    "ETag: \"abc\"\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  server.start(request, 0, response, 0, content);
+
+  boost::asio::io_service io_service;
+  urdl::read_stream stream1(io_service);
+
+  stream1.open("http://localhost:" + port + "/");
+
+  std::string returned_content(stream1.content_length(), 0);
+  boost::asio::read(stream1, boost::asio::buffer(
+        &returned_content[0], returned_content.size()));
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+  BOOST_CHECK(stream1.content_type() == "text/plain");
+  BOOST_CHECK(stream1.content_length() == 13);
+  BOOST_CHECK(returned_content == content);
+}
+
 // Test synchronous HTTP with an error status returned by the server.
 void read_stream_synchronous_http_not_found_test()
 {
@@ -268,13 +309,410 @@ void read_stream_asynchronous_http_not_found_test()
   BOOST_CHECK(ec == urdl::http::errc::not_found);
 }
 
+// Test synchronous HTTP reusing a persistent connection.
+void read_stream_synchronous_http_keep_alive_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 13\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  server.start_persistent(request, response, content, 2);
+
+  boost::asio::io_service io_service;
+  boost::shared_ptr<urdl::http::connection_pool> pool(
+      new urdl::http::connection_pool);
+
+  for (int i = 0; i < 2; ++i)
+  {
+    urdl::read_stream stream1(io_service);
+    stream1.set_option(urdl::http::keep_alive(pool));
+    stream1.open("http://localhost:" + port + "/");
+
+    std::string returned_content;
+    boost::system::error_code ec;
+    char buffer[4];
+    for (;;)
+    {
+      std::size_t length = stream1.read_some(boost::asio::buffer(buffer), ec);
+      returned_content.append(buffer, length);
+      if (ec)
+        break;
+    }
+
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    BOOST_CHECK(returned_content == content);
+
+    stream1.close();
+    BOOST_CHECK(pool->idle_count() == 1);
+  }
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+}
+
+// Test that a request is sent again on a fresh connection when the pooled
+// one it was written to has been dropped by the server, even though an
+// earlier response on the same stream got as far as its headers.
+void read_stream_http_keep_alive_reset_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string old_request =
+    "GET /old HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string moved_response =
+    "HTTP/1.1 301 Moved Permanently\r\n"
+    "Location: http://localhost:" + port + "/new\r\n"
+    "Content-Length: 0\r\n\r\n";
+  std::string new_request =
+    "GET /new HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 13\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  for (int async = 0; async < 2; ++async)
+  {
+    boost::asio::io_service io_service;
+    boost::shared_ptr<urdl::http::connection_pool> pool(
+        new urdl::http::connection_pool);
+    urdl::read_stream stream1(io_service);
+    stream1.set_option(urdl::http::keep_alive(pool));
+    stream1.set_option(urdl::http::max_redirects(0));
+
+    // The redirect leaves its connection in the pool, where the server
+    // then drops it.
+    server.start_and_reset(old_request, moved_response, "");
+    boost::system::error_code ec;
+    stream1.open("http://localhost:" + port + "/old", ec);
+    BOOST_CHECK(ec == urdl::http::errc::moved_permanently);
+    stream1.close();
+    BOOST_CHECK(pool->idle_count() == 1);
+    BOOST_CHECK(server.stop());
+
+    server.start(new_request, 0, response, 0, content);
+    if (async)
+    {
+      std::size_t bytes_transferred = 0;
+      handler h = { ec, bytes_transferred };
+      stream1.async_open("http://localhost:" + port + "/new", h);
+      io_service.run();
+    }
+    else
+    {
+      stream1.open("http://localhost:" + port + "/new", ec);
+    }
+    BOOST_CHECK(!ec);
+
+    std::string returned_content(64, 0);
+    std::size_t length = boost::asio::read(stream1, boost::asio::buffer(
+          &returned_content[0], returned_content.size()), ec);
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    returned_content.resize(length);
+    BOOST_CHECK(returned_content == content);
+
+    stream1.close();
+    BOOST_CHECK(server.stop());
+  }
+}
+
+// Test asynchronous HTTP reading a chunked body from a persistent connection.
+void read_stream_asynchronous_http_chunked_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content =
+    "7\r\nHello, \r\n"
+    "6;ext=1\r\nWorld!\r\n"
+    "0\r\nX-Trailer: 1\r\n\r\n";
+
+  server.start_persistent(request, response, content, 2);
+
+  boost::asio::io_service io_service;
+  boost::shared_ptr<urdl::http::connection_pool> pool(
+      new urdl::http::connection_pool);
+
+  for (int i = 0; i < 2; ++i)
+  {
+    urdl::read_stream stream1(io_service);
+    stream1.set_option(urdl::http::keep_alive(pool));
+
+    boost::system::error_code ec;
+    std::size_t bytes_transferred = 0;
+    handler h = { ec, bytes_transferred };
+
+    stream1.async_open("http://localhost:" + port + "/", h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(!ec);
+
+    std::string returned_content(64, 0);
+    boost::asio::async_read(stream1, boost::asio::buffer(
+          &returned_content[0], returned_content.size()), h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    returned_content.resize(bytes_transferred);
+
+    BOOST_CHECK(returned_content == "Hello, World!");
+
+    stream1.close();
+    BOOST_CHECK(pool->idle_count() == 1);
+  }
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+}
+
+#if !defined(URDL_DISABLE_ZLIB)
+// Test asynchronous HTTP reading of a gzip-compressed body.
+void read_stream_asynchronous_http_gzip_test()
+{
+  http_server server;
+  std::string port = boost::lexical_cast<std::string>(server.port());
+
+  std::string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:" + port + "\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 37\r\n"
+    "Content-Encoding: gzip\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content(
+    "\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xf3\x48\xcd\xc9\xc9\xd7\x51"
+    "\x08\xcf\x2f\xca\x49\x51\x54\xf0\xc0\xcd\x03\x00\xcc\x62\x83\x76\x29"
+    "\x00\x00\x00", 37);
+
+  server.start_persistent(request, response, content, 2);
+
+  boost::asio::io_service io_service;
+  boost::shared_ptr<urdl::http::connection_pool> pool(
+      new urdl::http::connection_pool);
+
+  for (int i = 0; i < 2; ++i)
+  {
+    urdl::read_stream stream1(io_service);
+    stream1.set_option(urdl::http::keep_alive(pool));
+    stream1.set_option(urdl::http::decompress(true));
+
+    boost::system::error_code ec;
+    std::size_t bytes_transferred = 0;
+    handler h = { ec, bytes_transferred };
+
+    stream1.async_open("http://localhost:" + port + "/", h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(!ec);
+
+    std::string returned_content(64, 0);
+    boost::asio::async_read(stream1, boost::asio::buffer(
+          &returned_content[0], returned_content.size()), h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    returned_content.resize(bytes_transferred);
+
+    BOOST_CHECK(returned_content
+        == "Hello, World! Hello, World! Hello, World!");
+
+    stream1.close();
+    BOOST_CHECK(pool->idle_count() == 1);
+  }
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+}
+#endif // !defined(URDL_DISABLE_ZLIB)
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Test asynchronous HTTP reading over a UNIX domain socket, reusing the
+// connection for a second request.
+void read_stream_asynchronous_http_local_test()
+{
+  local_http_server server("urdl_test.sock");
+
+  std::string request =
+    "GET /tile HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+  std::string response =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 13\r\n"
+    "Content-Type: text/plain\r\n\r\n";
+  std::string content = "Hello, World!";
+
+  server.start_persistent(request, response, content, 2);
+
+  boost::asio::io_service io_service;
+  boost::shared_ptr<urdl::http::connection_pool> pool(
+      new urdl::http::connection_pool);
+
+  for (int i = 0; i < 2; ++i)
+  {
+    urdl::read_stream stream1(io_service);
+    stream1.set_option(urdl::http::keep_alive(pool));
+
+    boost::system::error_code ec;
+    std::size_t bytes_transferred = 0;
+    handler h = { ec, bytes_transferred };
+
+    // The host component is the percent-encoded path of the socket.
+    stream1.async_open("http+unix://urdl%5Ftest.sock/tile", h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(!ec);
+
+    std::string returned_content(64, 0);
+    boost::asio::async_read(stream1, boost::asio::buffer(
+          &returned_content[0], returned_content.size()), h);
+    io_service.reset();
+    io_service.run();
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    returned_content.resize(bytes_transferred);
+
+    BOOST_CHECK(returned_content == content);
+
+    stream1.close();
+    BOOST_CHECK(pool->idle_count() == 1);
+  }
+
+  bool request_matched = server.stop();
+
+  BOOST_CHECK(request_matched);
+}
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+// Test that a permanent redirect is remembered for sibling URLs, and
+// forgotten again when the new location stops working.
+void read_stream_http_cache_redirects_test()
+{
+  http_server old_server;
+  http_server new_server;
+  std::string old_port = boost::lexical_cast<std::string>(old_server.port());
+  std::string new_port = boost::lexical_cast<std::string>(new_server.port());
+
+  std::string old_request_1 =
+    "GET /tiles/1.json HTTP/1.0\r\n"
+    "Host: localhost:" + old_port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string old_response_1 =
+    "HTTP/1.0 301 Moved Permanently\r\n"
+    "Location: http://localhost:" + new_port + "/v2/1.json\r\n"
+    "Content-Length: 0\r\n\r\n";
+  std::string new_request_1 =
+    "GET /v2/1.json HTTP/1.0\r\n"
+    "Host: localhost:" + new_port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string new_request_2 =
+    "GET /v2/2.json HTTP/1.0\r\n"
+    "Host: localhost:" + new_port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string new_request_3 =
+    "GET /v2/3.json HTTP/1.0\r\n"
+    "Host: localhost:" + new_port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string old_request_3 =
+    "GET /tiles/3.json HTTP/1.0\r\n"
+    "Host: localhost:" + old_port + "\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n\r\n";
+  std::string ok_response =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Length: 2\r\n\r\n";
+  std::string not_found_response =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+  boost::asio::io_service io_service;
+  urdl::read_stream stream1(io_service);
+  stream1.set_option(urdl::http::cache_redirects(true));
+
+  // The first tile is redirected by the old server.
+  old_server.start(old_request_1, 0, old_response_1, 0, "");
+  new_server.start(new_request_1, 0, ok_response, 0, "ok");
+  boost::system::error_code ec;
+  std::size_t bytes_transferred = 0;
+  handler h = { ec, bytes_transferred };
+  stream1.async_open("http://localhost:" + old_port + "/tiles/1.json", h);
+  io_service.run();
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(old_server.stop());
+  BOOST_CHECK(new_server.stop());
+  stream1.close();
+
+  // The second goes straight to the new server.
+  new_server.start(new_request_2, 0, ok_response, 0, "ok");
+  stream1.open("http://localhost:" + old_port + "/tiles/2.json", ec);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(new_server.stop());
+  stream1.close();
+
+  // The third is not found at the new location, so the old server is asked.
+  new_server.start(new_request_3, 0, not_found_response, 0, "");
+  old_server.start(old_request_3, 0, ok_response, 0, "ok");
+  stream1.open("http://localhost:" + old_port + "/tiles/3.json", ec);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(new_server.stop());
+  BOOST_CHECK(old_server.stop());
+}
+
 test_suite* init_unit_test_suite(int, char*[])
 {
   test_suite* test = BOOST_TEST_SUITE("read_stream");
   test->add(BOOST_TEST_CASE(&read_stream_compile_test));
   test->add(BOOST_TEST_CASE(&read_stream_synchronous_http_test));
+  test->add(BOOST_TEST_CASE(&read_stream_synchronous_http_headers_test));
   test->add(BOOST_TEST_CASE(&read_stream_synchronous_http_not_found_test));
   test->add(BOOST_TEST_CASE(&read_stream_asynchronous_http_test));
   test->add(BOOST_TEST_CASE(&read_stream_asynchronous_http_not_found_test));
+  test->add(BOOST_TEST_CASE(&read_stream_synchronous_http_keep_alive_test));
+  test->add(BOOST_TEST_CASE(&read_stream_http_keep_alive_reset_test));
+  test->add(BOOST_TEST_CASE(&read_stream_http_cache_redirects_test));
+  test->add(BOOST_TEST_CASE(&read_stream_asynchronous_http_chunked_test));
+#if !defined(URDL_DISABLE_ZLIB)
+  test->add(BOOST_TEST_CASE(&read_stream_asynchronous_http_gzip_test));
+#endif // !defined(URDL_DISABLE_ZLIB)
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  test->add(BOOST_TEST_CASE(&read_stream_asynchronous_http_local_test));
+#endif // defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
   return test;
 }
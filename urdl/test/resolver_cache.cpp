@@ -0,0 +1,225 @@
+//
+// resolver_cache.cpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2009 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include "urdl/detail/resolver_cache.hpp"
+
+#include "unit_test.hpp"
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/thread/thread.hpp>
+
+typedef urdl::detail::resolver_cache resolver_cache;
+
+namespace {
+
+resolver_cache::endpoints_ptr make_endpoints(const char* address,
+    unsigned short port)
+{
+  boost::shared_ptr<resolver_cache::endpoints_type> endpoints(
+      new resolver_cache::endpoints_type);
+  endpoints->push_back(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address_v4::from_string(address), port));
+  return endpoints;
+}
+
+void sleep_ms(long ms)
+{
+  boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+}
+
+} // namespace
+
+// Ensure all functions compile correctly.
+void resolver_cache_compile_test()
+{
+  resolver_cache& cache = resolver_cache::instance();
+
+  resolver_cache::endpoints_ptr endpoints;
+  boost::system::error_code ec;
+  bool refresh = false;
+  bool b = cache.find("host", "80", endpoints, ec, true, refresh);
+  (void)b;
+
+  cache.store("host", "80", endpoints, ec);
+  cache.clear();
+}
+
+// Test that answers are served until the ttl runs out.
+void resolver_cache_ttl_test()
+{
+  resolver_cache cache(boost::posix_time::milliseconds(50),
+      boost::posix_time::seconds(0), boost::posix_time::seconds(5));
+
+  resolver_cache::endpoints_ptr endpoints;
+  boost::system::error_code ec;
+  bool refresh = true;
+  BOOST_CHECK(!cache.find("host", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(!refresh);
+
+  resolver_cache::endpoints_ptr stored = make_endpoints("10.0.0.1", 80);
+  cache.store("host", "80", stored, ec);
+  BOOST_CHECK(cache.find("host", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(endpoints == stored);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(!refresh);
+
+  // Entries are per host and port.
+  BOOST_CHECK(!cache.find("host", "8080", endpoints, ec, false, refresh));
+  BOOST_CHECK(!cache.find("other", "80", endpoints, ec, false, refresh));
+
+  sleep_ms(100);
+  BOOST_CHECK(!cache.find("host", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(!cache.find("host", "80", endpoints, ec, true, refresh));
+
+  cache.store("host", "80", stored, ec);
+  cache.clear();
+  BOOST_CHECK(!cache.find("host", "80", endpoints, ec, false, refresh));
+}
+
+// Test that failed lookups are remembered for the negative ttl only, and
+// never served stale.
+void resolver_cache_negative_test()
+{
+  resolver_cache cache(boost::posix_time::seconds(60),
+      boost::posix_time::seconds(60), boost::posix_time::milliseconds(50));
+
+  resolver_cache::endpoints_ptr endpoints;
+  boost::system::error_code ec;
+  bool refresh = false;
+  cache.store("missing", "80", resolver_cache::endpoints_ptr(),
+      boost::asio::error::host_not_found);
+  BOOST_CHECK(cache.find("missing", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(ec == boost::asio::error::host_not_found);
+  BOOST_CHECK(!refresh);
+
+  sleep_ms(100);
+  BOOST_CHECK(!cache.find("missing", "80", endpoints, ec, true, refresh));
+  BOOST_CHECK(!refresh);
+
+  // A cancelled lookup says nothing about the host.
+  cache.store("aborted", "80", resolver_cache::endpoints_ptr(),
+      boost::asio::error::operation_aborted);
+  BOOST_CHECK(!cache.find("aborted", "80", endpoints, ec, false, refresh));
+}
+
+// Test that a stale answer is served while one refresh runs, and replaced
+// when the refresh succeeds.
+void resolver_cache_stale_refresh_test()
+{
+  resolver_cache cache(boost::posix_time::milliseconds(50),
+      boost::posix_time::seconds(60), boost::posix_time::seconds(5));
+
+  resolver_cache::endpoints_ptr stale = make_endpoints("10.0.0.1", 80);
+  boost::system::error_code ec;
+  cache.store("127.0.0.1", "80", stale, ec);
+  sleep_ms(100);
+
+  // Only with allow_stale, and only the first caller refreshes.
+  resolver_cache::endpoints_ptr endpoints;
+  bool refresh = false;
+  BOOST_CHECK(!cache.find("127.0.0.1", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(cache.find("127.0.0.1", "80", endpoints, ec, true, refresh));
+  BOOST_CHECK(endpoints == stale);
+  BOOST_CHECK(refresh);
+  BOOST_CHECK(cache.find("127.0.0.1", "80", endpoints, ec, true, refresh));
+  BOOST_CHECK(endpoints == stale);
+  BOOST_CHECK(!refresh);
+
+  // A numeric host resolves without a name server.
+  boost::asio::io_service io_service;
+  cache.async_refresh(io_service, "127.0.0.1", "80");
+  io_service.run();
+
+  BOOST_CHECK(cache.find("127.0.0.1", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(!refresh);
+  BOOST_CHECK(endpoints && endpoints->size() == 1);
+  if (endpoints && endpoints->size() == 1)
+  {
+    BOOST_CHECK((*endpoints)[0].address().to_string() == "127.0.0.1");
+    BOOST_CHECK((*endpoints)[0].port() == 80);
+  }
+}
+
+// Test that a failed refresh keeps the old answer until it is too stale.
+void resolver_cache_failed_refresh_test()
+{
+  resolver_cache cache(boost::posix_time::milliseconds(50),
+      boost::posix_time::milliseconds(300), boost::posix_time::seconds(5));
+
+  // An unknown service name fails to resolve without a name server.
+  const char* port = "urdl-no-such-service";
+  resolver_cache::endpoints_ptr stale = make_endpoints("10.0.0.1", 80);
+  boost::system::error_code ec;
+  cache.store("127.0.0.1", port, stale, ec);
+  sleep_ms(100);
+
+  resolver_cache::endpoints_ptr endpoints;
+  bool refresh = false;
+  BOOST_CHECK(cache.find("127.0.0.1", port, endpoints, ec, true, refresh));
+  BOOST_CHECK(refresh);
+
+  boost::asio::io_service io_service;
+  cache.async_refresh(io_service, "127.0.0.1", port);
+  io_service.run();
+
+  // The old answer is still served, and another refresh may be tried.
+  BOOST_CHECK(cache.find("127.0.0.1", port, endpoints, ec, true, refresh));
+  BOOST_CHECK(endpoints == stale);
+  BOOST_CHECK(!ec);
+  BOOST_CHECK(refresh);
+
+  sleep_ms(300);
+  BOOST_CHECK(!cache.find("127.0.0.1", port, endpoints, ec, true, refresh));
+}
+
+// Test that a full cache drops unusable entries first, and everything if
+// that is not enough.
+void resolver_cache_purge_test()
+{
+  resolver_cache cache(boost::posix_time::milliseconds(20),
+      boost::posix_time::milliseconds(20), boost::posix_time::milliseconds(20),
+      2);
+
+  resolver_cache::endpoints_ptr stored = make_endpoints("10.0.0.1", 80);
+  resolver_cache::endpoints_ptr endpoints;
+  boost::system::error_code ec;
+  bool refresh = false;
+  cache.store("a", "80", stored, ec);
+  cache.store("b", "80", stored, ec);
+  sleep_ms(100);
+  cache.store("c", "80", stored, ec);
+  cache.store("d", "80", stored, ec);
+  BOOST_CHECK(cache.find("c", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(cache.find("d", "80", endpoints, ec, false, refresh));
+
+  cache.store("e", "80", stored, ec);
+  BOOST_CHECK(!cache.find("c", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(!cache.find("d", "80", endpoints, ec, false, refresh));
+  BOOST_CHECK(!cache.find("e", "80", endpoints, ec, false, refresh));
+}
+
+test_suite* init_unit_test_suite(int, char*[])
+{
+  test_suite* test = BOOST_TEST_SUITE("resolver_cache");
+  test->add(BOOST_TEST_CASE(&resolver_cache_compile_test));
+  test->add(BOOST_TEST_CASE(&resolver_cache_ttl_test));
+  test->add(BOOST_TEST_CASE(&resolver_cache_negative_test));
+  test->add(BOOST_TEST_CASE(&resolver_cache_stale_refresh_test));
+  test->add(BOOST_TEST_CASE(&resolver_cache_failed_refresh_test));
+  test->add(BOOST_TEST_CASE(&resolver_cache_purge_test));
+  return test;
+}
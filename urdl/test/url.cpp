@@ -94,6 +94,10 @@ void url_compile_test()
   // operator<
 
   want<bool>(const_url1 < const_url2);
+
+  // set_target()
+
+  url1.set_target("/path?query", 11);
 }
 
 // Test URL parsing.
@@ -302,10 +306,36 @@ void url_from_string_test()
   BOOST_CHECK(url.fragment() == "fragment");
 }
 
+void url_set_target_test()
+{
+  urdl::url url = urdl::url::from_string("http://user@host:123/old?q#f");
+
+  url.set_target("/1/2/3.geojson", 14);
+  BOOST_CHECK(url.protocol() == "http");
+  BOOST_CHECK(url.user_info() == "user");
+  BOOST_CHECK(url.host() == "host");
+  BOOST_CHECK(url.port() == 123);
+  BOOST_CHECK(url.path() == "/1/2/3.geojson");
+  BOOST_CHECK(url.query() == "");
+  BOOST_CHECK(url.fragment() == "");
+
+  url.set_target("/path?a=1#frag", 14);
+  BOOST_CHECK(url.path() == "/path");
+  BOOST_CHECK(url.query() == "a=1");
+  BOOST_CHECK(url.fragment() == "frag");
+  BOOST_CHECK(url.to_string() == "http://user@host:123/path?a=1#frag");
+
+  url.set_target("/path#frag?x", 12);
+  BOOST_CHECK(url.path() == "/path");
+  BOOST_CHECK(url.query() == "");
+  BOOST_CHECK(url.fragment() == "frag?x");
+}
+
 test_suite* init_unit_test_suite(int, char*[])
 {
   test_suite* test = BOOST_TEST_SUITE("url");
   test->add(BOOST_TEST_CASE(&url_compile_test));
   test->add(BOOST_TEST_CASE(&url_from_string_test));
+  test->add(BOOST_TEST_CASE(&url_set_target_test));
   return test;
 }